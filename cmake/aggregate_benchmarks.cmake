@@ -0,0 +1,33 @@
+## ---------------------------------------------------------------------
+##
+## Copyright (C) 2015 by the deal.II authors
+##
+## This file is part of the deal.II code gallery.
+##
+## The deal.II code gallery is free software; you can use it, redistribute
+## it, and/or modify it under the terms of the GNU Lesser General
+## Public License as published by the Free Software Foundation; either
+## version 2.1 of the License, or (at your option) any later version.
+## The full text of the license can be found in the file LICENSE at
+## the top level of the deal.II distribution.
+##
+## ---------------------------------------------------------------------
+
+#
+# Concatenate the reports written by run_benchmark.cmake into one file.
+# Expects REPORTS (a list of files, separated by '|' since ';' does not
+# survive the command line) and OUTPUT.
+#
+
+STRING(TIMESTAMP _date "%Y-%m-%d %H:%M:%S")
+FILE(WRITE ${OUTPUT} "deal.II code gallery benchmark report, ${_date}\n\n")
+
+STRING(REPLACE "|" ";" REPORTS "${REPORTS}")
+FOREACH(_report ${REPORTS})
+  IF(EXISTS ${_report})
+    FILE(READ ${_report} _content)
+    FILE(APPEND ${OUTPUT} "${_content}\n")
+  ENDIF()
+ENDFOREACH()
+
+MESSAGE(STATUS "Benchmark report written to ${OUTPUT}")
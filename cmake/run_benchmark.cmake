@@ -0,0 +1,135 @@
+## ---------------------------------------------------------------------
+##
+## Copyright (C) 2015 by the deal.II authors
+##
+## This file is part of the deal.II code gallery.
+##
+## The deal.II code gallery is free software; you can use it, redistribute
+## it, and/or modify it under the terms of the GNU Lesser General
+## Public License as published by the Free Software Foundation; either
+## version 2.1 of the License, or (at your option) any later version.
+## The full text of the license can be found in the file LICENSE at
+## the top level of the deal.II distribution.
+##
+## ---------------------------------------------------------------------
+
+#
+# Configure, build, and run the benchmarks of one code gallery program.
+# This script is run in script mode (cmake -P) by the "benchmark" target
+# of the top-level CMakeLists.txt and expects the following variables:
+#
+#   PROGRAM      - the name of the program's directory
+#   SOURCE_DIR   - the program's source directory
+#   BINARY_DIR   - the directory in which to build and run it
+#   REPORT       - the file to which to write the results
+#   DEAL_II_DIR  - (optional) where to find deal.II
+#   MPIEXEC_EXECUTABLE, MPIEXEC_NUMPROC_FLAG, MPIEXEC_PREFLAGS
+#                - (optional) how to start a program on several processes
+#
+# Each line of ${SOURCE_DIR}/doc/benchmark that is not empty and does not
+# start with '#' holds the command line arguments of one benchmark run.
+# A line may start with "np=N", for example
+#
+#   np=4 --benchmark=parallel-modes --refinement-steps=10
+#
+# and is then run on N MPI processes as
+#   ${MPIEXEC_EXECUTABLE} ${MPIEXEC_NUMPROC_FLAG} N ${MPIEXEC_PREFLAGS} <program> <arguments>
+# If no MPI launcher was found, such lines are reported as skipped.
+#
+
+FILE(MAKE_DIRECTORY ${BINARY_DIR})
+FILE(WRITE ${REPORT} "==== ${PROGRAM} ====\n")
+
+SET(_configure_flags -DCMAKE_BUILD_TYPE=Release)
+IF(NOT "${DEAL_II_DIR}" STREQUAL "")
+  LIST(APPEND _configure_flags -DDEAL_II_DIR=${DEAL_II_DIR})
+ENDIF()
+
+EXECUTE_PROCESS(
+  COMMAND ${CMAKE_COMMAND} ${_configure_flags} ${SOURCE_DIR}
+  WORKING_DIRECTORY ${BINARY_DIR}
+  RESULT_VARIABLE _result
+  OUTPUT_VARIABLE _output
+  ERROR_VARIABLE _output
+  )
+IF(NOT _result EQUAL 0)
+  FILE(APPEND ${REPORT} "Configuration failed:\n${_output}\n")
+  RETURN()
+ENDIF()
+
+EXECUTE_PROCESS(
+  COMMAND ${CMAKE_COMMAND} --build .
+  WORKING_DIRECTORY ${BINARY_DIR}
+  RESULT_VARIABLE _result
+  OUTPUT_VARIABLE _output
+  ERROR_VARIABLE _output
+  )
+IF(NOT _result EQUAL 0)
+  FILE(APPEND ${REPORT} "Build failed:\n${_output}\n")
+  RETURN()
+ENDIF()
+
+#
+# Record the deal.II version the program was built against, so that
+# reports from different versions can be compared:
+#
+FILE(STRINGS ${BINARY_DIR}/CMakeCache.txt _deal_ii_dir REGEX "^deal.II_DIR:")
+STRING(REGEX REPLACE "^deal.II_DIR:[A-Z]*=" "" _deal_ii_dir "${_deal_ii_dir}")
+SET(_version "unknown")
+IF(EXISTS ${_deal_ii_dir}/deal.IIConfigVersion.cmake)
+  FILE(STRINGS ${_deal_ii_dir}/deal.IIConfigVersion.cmake _version
+    REGEX "SET\\(PACKAGE_VERSION \"")
+  STRING(REGEX REPLACE ".*PACKAGE_VERSION \"([^\"]*)\".*" "\\1"
+    _version "${_version}")
+ENDIF()
+FILE(APPEND ${REPORT} "deal.II version: ${_version}\n")
+
+#
+# The name of the executable is the TARGET set in the program's
+# CMakeLists.txt:
+#
+FILE(STRINGS ${SOURCE_DIR}/CMakeLists.txt _target
+  REGEX "^[ \t]*SET\\(TARGET ")
+STRING(REGEX REPLACE ".*SET\\(TARGET \"?([^\" )]*)\"?\\).*" "\\1"
+  _target "${_target}")
+
+FILE(STRINGS ${SOURCE_DIR}/doc/benchmark _benchmarks)
+FOREACH(_benchmark ${_benchmarks})
+  IF(NOT "${_benchmark}" STREQUAL "" AND NOT "${_benchmark}" MATCHES "^#")
+    SET(_launcher "")
+    SET(_arguments "${_benchmark}")
+    IF("${_benchmark}" MATCHES "^np=([0-9]+)[ \t]+(.*)$")
+      SET(_arguments "${CMAKE_MATCH_2}")
+      IF(NOT "${MPIEXEC_EXECUTABLE}" STREQUAL "")
+        SEPARATE_ARGUMENTS(_preflags UNIX_COMMAND "${MPIEXEC_PREFLAGS}")
+        SET(_launcher ${MPIEXEC_EXECUTABLE} ${MPIEXEC_NUMPROC_FLAG}
+          ${CMAKE_MATCH_1} ${_preflags})
+      ELSE()
+        SET(_launcher "NOTFOUND")
+      ENDIF()
+    ENDIF()
+    SEPARATE_ARGUMENTS(_arguments UNIX_COMMAND "${_arguments}")
+
+    IF("${_launcher}" STREQUAL "NOTFOUND")
+      FILE(APPEND ${REPORT}
+        "---- ${_target} ${_benchmark}\n"
+        "skipped: no MPI launcher (mpiexec) was found\n\n")
+    ELSE()
+      STRING(TIMESTAMP _start "%s")
+      EXECUTE_PROCESS(
+        COMMAND ${_launcher} ${BINARY_DIR}/${_target} ${_arguments}
+        WORKING_DIRECTORY ${BINARY_DIR}
+        RESULT_VARIABLE _result
+        OUTPUT_VARIABLE _output
+        ERROR_VARIABLE _output
+        )
+      STRING(TIMESTAMP _end "%s")
+      MATH(EXPR _elapsed "${_end} - ${_start}")
+
+      FILE(APPEND ${REPORT}
+        "---- ${_target} ${_benchmark}\n"
+        "exit code: ${_result}, wall time: ${_elapsed} s\n"
+        "${_output}\n")
+    ENDIF()
+  ENDIF()
+ENDFOREACH()
@@ -0,0 +1,8052 @@
+/* ---------------------------------------------------------------------
+ *
+ * Copyright (C) 1999 - 2015 by the deal.II authors
+ *
+ * This file is part of the deal.II library.
+ *
+ * The deal.II library is free software; you can use it, redistribute
+ * it, and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * The full text of the license can be found in the file LICENSE at
+ * the top level of the deal.II distribution.
+ *
+ * ---------------------------------------------------------------------
+
+ */
+
+// This program starts from the two meshes of the step-1 tutorial program
+// -- a globally refined square, and a ring refined towards its inner
+// circle -- and asks what it takes to produce such meshes quickly and
+// reliably when they get large. It adds, section by section: compressed
+// and multi-threaded output of grids in several formats, fast readers for
+// large mesh files, a guard against running out of memory, several
+// strategies for choosing the cells to refine, checks of the quality of
+// the resulting mesh, the same refinement on shared and distributed
+// triangulations, and a set of benchmarks that measure each of these.
+// Without command line arguments, it produces the two grids of step-1.
+// The ProgramOptions structure below lists what else it can be asked to
+// do, and the file doc/benchmark lists the benchmarks that "make
+// benchmark" in the top-level directory of the code gallery runs.
+
+// @sect3{Include files}
+
+// The most fundamental class in the library is the Triangulation class, which
+// is declared here:
+#include <deal.II/grid/tria.h>
+// We need the following two includes for loops over cells and/or faces:
+#include <deal.II/grid/tria_accessor.h>
+#include <deal.II/grid/tria_iterator.h>
+// Here are some functions to generate standard grids:
+#include <deal.II/grid/grid_generator.h>
+// We would like to use faces and cells which are not straight lines,
+// or bi-linear quads, so we import some classes which predefine some
+// manifold descriptions:
+#include <deal.II/grid/manifold_lib.h>
+// Output of grids in various graphics formats:
+#include <deal.II/grid/grid_out.h>
+// To read grids from files, and to put the cells we read ourselves into
+// the order the triangulation expects:
+#include <deal.II/grid/grid_in.h>
+#include <deal.II/grid/grid_reordering.h>
+// Curved edges are described by a higher order mapping:
+#include <deal.II/fe/mapping_q_generic.h>
+// We report errors in the command line arguments and in the output
+// streams through deal.II's exception mechanism, and use some of the
+// string conversion functions from the Utilities namespace:
+#include <deal.II/base/exceptions.h>
+#include <deal.II/base/utilities.h>
+// The benchmarks measure run times with these classes:
+#include <deal.II/base/timer.h>
+// Several of the stages below run in parallel on tasks and threads, and
+// some use the SIMD instructions of the processor:
+#include <deal.II/base/multithread_info.h>
+#include <deal.II/base/thread_management.h>
+#include <deal.II/base/vectorization.h>
+// For refinement based on a per-cell indicator, we need a vector to store
+// it in and the functions that select cells based on it:
+#include <deal.II/lac/vector.h>
+#include <deal.II/grid/grid_refinement.h>
+// Partitioning the mesh with METIS is done by a function in GridTools:
+#include <deal.II/grid/grid_tools.h>
+// When running on several MPI processes, we use the triangulation classes
+// for parallel computations; the one that distributes the mesh among the
+// processes requires deal.II to be configured with p4est:
+#include <deal.II/base/mpi.h>
+#include <deal.II/base/conditional_ostream.h>
+#include <deal.II/distributed/shared_tria.h>
+#include <deal.II/distributed/tria.h>
+
+// Grid files can optionally be compressed on the fly. deal.II links with
+// zlib if it was configured with it, and the CMakeLists.txt file of this
+// program looks for the zstd library and defines RING_REFINEMENT_WITH_ZSTD if it
+// found it:
+#ifdef DEAL_II_WITH_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef RING_REFINEMENT_WITH_ZSTD
+#  include <zstd.h>
+#endif
+
+// Input files are mapped into memory with the following POSIX functions:
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The thread-scaling benchmark pins the threads of the task scheduler to
+// cores, for which it needs to observe the threads of the Threading
+// Building Blocks, and the affinity functions of Linux:
+#ifdef DEAL_II_WITH_THREADS
+#  include <tbb/task_scheduler_observer.h>
+#  include <pthread.h>
+#  include <sched.h>
+#endif
+
+// This is needed for C++ output:
+#include <iostream>
+#include <fstream>
+// And this for the declarations of the `sqrt' and `fabs' functions:
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <sstream>
+// The compression stage runs on its own thread and receives the formatted
+// text through a queue:
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The final step in importing deal.II is this: All deal.II functions and
+// classes are in a namespace <code>dealii</code>, to make sure they don't
+// clash with symbols from other libraries you may want to use in conjunction
+// with deal.II. One could use these functions and classes by prefixing every
+// use of these names by <code>dealii::</code>, but that would quickly become
+// cumbersome and annoying. Rather, we simply import the entire deal.II
+// namespace for general use:
+using namespace dealii;
+
+// @sect3{Program options}
+
+// All of what follows can be controlled from the command line. We collect
+// the settings in the following structure, which is filled by
+// parse_command_line() further down and then handed to the functions that
+// create the grids.
+//
+// The first group of settings selects how cells are chosen for refinement
+// in second_grid(); see the functions in the section on marking cells
+// below.
+enum class RefinementStrategy
+{
+  inner_boundary,
+  fixed_number,
+  fixed_fraction,
+  vertex_centric,
+  hierarchical,
+  cached,
+  point_cloud,
+  signed_distance
+};
+
+
+// What to do if refining would exceed the memory budget: stop refining,
+// refine fewer cells, or end the program with an error. See
+// check_refinement_memory():
+enum class OverBudgetAction
+{
+  stop,
+  degrade,
+  error
+};
+
+
+// When the program is run on several MPI processes, second_grid() can use
+// one of deal.II's triangulation classes for parallel computations; see
+// the section on running on several processes below:
+enum class ParallelMode
+{
+  serial,
+  shared,
+  distributed
+};
+
+
+// A second group selects how the mesh is partitioned into subdomains for
+// parallel solvers, if it is partitioned at all:
+enum class Partitioner
+{
+  zorder,
+  metis
+};
+
+
+struct ProgramOptions
+{
+  ProgramOptions ()
+    :
+    input_mesh_file (""),
+    output_formats (1, "eps"),
+    output_suffix (""),
+    write_curved_output (false),
+    mapping_degree (3),
+    n_circumferential_cells (10),
+    refinement_strategy (RefinementStrategy::inner_boundary),
+    n_refinement_steps (5),
+    report_mesh_quality (false),
+    refine_fraction (0.3),
+    coarsen_fraction (0.0),
+    max_n_cells (numbers::invalid_unsigned_int),
+    point_tolerance (0),
+    surface_band_width (0.25),
+    memory_budget (0),
+    over_budget_action (OverBudgetAction::stop),
+    report_memory_forecast (false),
+    parallel_mode (ParallelMode::serial),
+    threads_per_process (numbers::invalid_unsigned_int),
+    repartition (true),
+    boundary_cell_weight (0),
+    checkpoint_interval (0),
+    n_subdomains (0),
+    partitioner (Partitioner::zorder),
+    benchmark (""),
+    n_time_steps (200),
+    max_refinement_level (6),
+    configurations_file (""),
+    n_meshes (1000),
+    write_batch_output (true),
+    max_circumferential_cells (1000000),
+    n_global_refinements (0),
+    n_points (100000)
+  {}
+
+  // If not empty, a file in Gmsh or UCD format from which second_grid()
+  // reads its coarse mesh; see import_mesh() below.
+  std::string input_mesh_file;
+
+  // The formats in which to write the grids; any of "eps", "ucd", and
+  // "msh" (see write_grid() below).
+  std::vector<std::string> output_formats;
+
+  // A string appended to the name of every output file. Setting it to
+  // ".gz" or ".zst" (on the command line via <code>--compress=gzip</code>
+  // or <code>--compress=zstd</code>) makes all grid files come out
+  // compressed; see open_output_file() below.
+  std::string output_suffix;
+
+  // Whether second_grid() should also write its mesh with curved edges, and
+  // the polynomial degree of the mapping that describes them.
+  bool         write_curved_output;
+  unsigned int mapping_degree;
+
+  // The number of cells around the circumference of the coarse ring of
+  // second_grid(); see create_ring().
+  unsigned int n_circumferential_cells;
+
+  // How to mark cells in second_grid(), how many refinement steps to do
+  // there, whether to report the quality of the mesh after each of them,
+  // and the parameters that are passed on to the GridRefinement functions
+  // for the indicator-based strategies.
+  // <code>max_n_cells</code> is only used by the "fixed number" strategy.
+  RefinementStrategy refinement_strategy;
+  unsigned int       n_refinement_steps;
+  bool               report_mesh_quality;
+  double             refine_fraction;
+  double             coarsen_fraction;
+  unsigned int       max_n_cells;
+
+  // For the "point cloud" strategy, the file from which to read the points
+  // and how close to one of them a cell has to be to be refined. See the
+  // PointCloud class.
+  std::string        point_cloud_file;
+  double             point_tolerance;
+
+  // For the "signed distance" strategy, the file from which to read a
+  // signed distance function sampled on a grid (if empty, an example
+  // surface given by a formula is used), and the width of the band around
+  // the surface, relative to the size of a cell, within which cells are
+  // refined. See mark_cells_near_surface().
+  std::string        signed_distance_file;
+  double             surface_band_width;
+
+  // The memory (in MB) the program may use when refining, zero meaning no
+  // limit; what to do if the limit would be exceeded; and whether to print
+  // the forecast for every step. See check_refinement_memory().
+  unsigned int     memory_budget;
+  OverBudgetAction over_budget_action;
+  bool             report_memory_forecast;
+
+  // If not empty, the file to which the timeline of the stages of the
+  // program is written; see the TraceRecorder class.
+  std::string  trace_file;
+
+  // If not empty, the file (or named pipe) to which second_grid() writes a
+  // record of each refinement step; see the TelemetryStream class.
+  std::string  telemetry_file;
+
+  // Whether and how second_grid() is run on several processes, how many
+  // threads each process may use (by default, so many that the processes
+  // on a machine together use all of its cores) and, for a
+  // distributed triangulation, whether to redistribute cells among the
+  // processes after each refinement step and how much more than other
+  // cells a cell at the inner boundary costs. See the CellWeights class.
+  ParallelMode parallel_mode;
+  unsigned int threads_per_process;
+  bool         repartition;
+  unsigned int boundary_cell_weight;
+
+  // How many refinement steps to do between writing checkpoints of a
+  // distributed triangulation (zero meaning not to write any), and the
+  // name of a checkpoint to restart from, if any. See write_checkpoint().
+  unsigned int checkpoint_interval;
+  std::string  restart_file;
+
+  // The number of subdomains to partition the final mesh of second_grid()
+  // into (zero meaning not to partition it), and the method to do so.
+  unsigned int n_subdomains;
+  Partitioner  partitioner;
+
+  // If not empty, the name of a benchmark to run instead of creating the
+  // two grids of this program; see run_benchmark(). The remaining
+  // parameters are used by some of the benchmarks.
+  std::string  benchmark;
+  unsigned int n_time_steps;
+  unsigned int max_refinement_level;
+  std::string  configurations_file;
+  unsigned int n_meshes;
+  bool         write_batch_output;
+  unsigned int max_circumferential_cells;
+  unsigned int n_global_refinements;
+  unsigned int n_points;
+};
+
+
+
+// @sect3{Recording a timeline}
+
+// Timers tell us how long each part of the program takes in total, but not
+// when it ran and on which thread. Once mesh generation, the quality
+// check, file compression and telemetry run on several threads, it is
+// this information that shows where threads overlap and where they sit
+// idle. If asked for, the program therefore records when each stage
+// begins and ends on each thread, and at the end writes all of these
+// events in the JSON format of the Chrome trace viewer. The resulting
+// file can be opened in <code>chrome://tracing</code> or at
+// <code>ui.perfetto.dev</code>.
+//
+// Recording has to be cheap enough to leave it switched on while
+// benchmarking. Each thread therefore writes into its own buffer, so that
+// threads never wait for each other; only the first event of a thread
+// takes a lock, to register the thread's buffer with the recorder. An
+// event is a pointer to a string literal with its name and two time
+// stamps, and we record it as a single "complete" event when the stage
+// ends rather than as separate begin and end events. When recording is
+// switched off, a stage costs one check of an atomic flag.
+//
+// The buffers belong to the recorder, not to the threads, since the
+// threads of the task scheduler may end before we write the events. The
+// events must only be written once all threads have finished their work,
+// which is the case at the end of main().
+class TraceRecorder
+{
+public:
+  TraceRecorder ();
+
+  void enable ();
+  bool is_enabled () const;
+
+  std::int64_t now () const;
+  void record (const char         *name,
+               const std::int64_t  begin,
+               const std::int64_t  end);
+  void name_this_thread (const std::string &name);
+
+  void write_json (std::ostream &out) const;
+  std::size_t n_events () const;
+
+private:
+  struct TraceEvent
+  {
+    const char   *name;
+    std::int64_t  begin;
+    std::int64_t  duration;
+  };
+
+  struct ThreadBuffer
+  {
+    unsigned int             thread_index;
+    std::string              thread_name;
+    std::vector<TraceEvent>  events;
+  };
+
+  ThreadBuffer &buffer_of_this_thread ();
+
+  std::atomic<bool>                           enabled;
+  const std::chrono::steady_clock::time_point start_time;
+
+  mutable std::mutex                          buffers_mutex;
+  std::vector<std::unique_ptr<ThreadBuffer> > buffers;
+};
+
+
+
+TraceRecorder::TraceRecorder ()
+  :
+  enabled (false),
+  start_time (std::chrono::steady_clock::now())
+{}
+
+
+
+void TraceRecorder::enable ()
+{
+  enabled.store (true);
+}
+
+
+
+bool TraceRecorder::is_enabled () const
+{
+  return enabled.load (std::memory_order_relaxed);
+}
+
+
+
+// Time stamps are nanoseconds since the recorder was created:
+std::int64_t TraceRecorder::now () const
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>
+         (std::chrono::steady_clock::now() - start_time).count();
+}
+
+
+
+TraceRecorder::ThreadBuffer &TraceRecorder::buffer_of_this_thread ()
+{
+  thread_local ThreadBuffer *buffer = nullptr;
+  if (buffer == nullptr)
+    {
+      std::lock_guard<std::mutex> lock (buffers_mutex);
+      buffers.emplace_back (new ThreadBuffer());
+      buffer = buffers.back().get();
+      buffer->thread_index = buffers.size() - 1;
+      buffer->thread_name  = "thread " + Utilities::int_to_string (buffer->thread_index);
+      buffer->events.reserve (1024);
+    }
+  return *buffer;
+}
+
+
+
+void TraceRecorder::record (const char         *name,
+                            const std::int64_t  begin,
+                            const std::int64_t  end)
+{
+  const TraceEvent event = { name, begin, end - begin };
+  buffer_of_this_thread().events.push_back (event);
+}
+
+
+
+void TraceRecorder::name_this_thread (const std::string &name)
+{
+  if (is_enabled())
+    buffer_of_this_thread().thread_name = name;
+}
+
+
+
+std::size_t TraceRecorder::n_events () const
+{
+  std::lock_guard<std::mutex> lock (buffers_mutex);
+  std::size_t n = 0;
+  for (unsigned int t=0; t<buffers.size(); ++t)
+    n += buffers[t]->events.size();
+  return n;
+}
+
+
+
+// The trace viewer expects time stamps and durations in microseconds. We
+// first write one metadata event per thread that gives the thread its
+// name, and then all events of all threads:
+void TraceRecorder::write_json (std::ostream &out) const
+{
+  std::lock_guard<std::mutex> lock (buffers_mutex);
+
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::fixed
+      << std::setprecision (3);
+  bool first_event = true;
+  for (unsigned int t=0; t<buffers.size(); ++t)
+    {
+      out << (first_event ? "\n" : ",\n")
+          << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+          << buffers[t]->thread_index << ",\"args\":{\"name\":\""
+          << buffers[t]->thread_name << "\"}}";
+      first_event = false;
+    }
+  for (unsigned int t=0; t<buffers.size(); ++t)
+    for (unsigned int e=0; e<buffers[t]->events.size(); ++e)
+      {
+        const TraceEvent &event = buffers[t]->events[e];
+        out << ",\n{\"name\":\"" << event.name
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffers[t]->thread_index
+            << ",\"ts\":" << event.begin / 1000.
+            << ",\"dur\":" << event.duration / 1000. << '}';
+      }
+  out << "\n]}\n";
+}
+
+
+
+// There is one recorder for the whole program, which all functions below
+// can use:
+TraceRecorder trace_recorder;
+
+
+
+// Stages are recorded by creating an object of the following class at the
+// beginning of a block: it takes the time when it is created and records
+// the event when it is destroyed at the end of the block, however the
+// block is left. The name has to be a string literal, since only the
+// pointer to it is stored.
+class TraceScope
+{
+public:
+  TraceScope (const char *name);
+  ~TraceScope ();
+
+private:
+  const char         *name;
+  const std::int64_t  begin;
+};
+
+
+
+TraceScope::TraceScope (const char *name)
+  :
+  name (name),
+  begin (trace_recorder.is_enabled() ? trace_recorder.now() : -1)
+{}
+
+
+
+TraceScope::~TraceScope ()
+{
+  if (begin >= 0)
+    trace_recorder.record (name, begin, trace_recorder.now());
+}
+
+
+
+// @sect3{Compressed output streams}
+
+// For meshes with millions of cells, the files written by the GridOut
+// class become large and writing them is limited by the bandwidth of the
+// disk rather than by how fast we can format numbers. Compressing the
+// output helps, but compression itself is expensive and we do not want the
+// thread that formats the output to wait for it. The classes in this
+// section therefore form a small pipeline: GridOut writes into a stream
+// whose buffer is handed, one chunk at a time, to a second thread that
+// compresses it and writes the result to disk.
+//
+// The compression method is determined by the extension of the file name:
+enum class OutputCompression
+{
+  none,
+  gzip,
+  zstd
+};
+
+
+OutputCompression compression_from_file_name (const std::string &filename)
+{
+  const auto has_suffix = [&] (const std::string &suffix)
+  {
+    return ((filename.size() >= suffix.size())
+            &&
+            (filename.compare (filename.size()-suffix.size(), suffix.size(),
+                               suffix) == 0));
+  };
+
+  if (has_suffix (".gz"))
+    return OutputCompression::gzip;
+  else if (has_suffix (".zst"))
+    return OutputCompression::zstd;
+  else
+    return OutputCompression::none;
+}
+
+
+
+// The following is the stream buffer that implements the pipeline. The
+// std::ostream that uses it (through the GridOut functions) fills a buffer
+// of <code>chunk_size</code> bytes; whenever it is full, overflow() moves
+// it into a queue and the stream continues with an empty buffer. A worker
+// thread takes chunks out of the queue and feeds them to zlib or zstd.
+// The queue is bounded so that a compressor that cannot keep up does not
+// lead to unbounded memory consumption; in that case, the formatting
+// thread waits.
+//
+// All data reaches the file once close() is called: it queues whatever is
+// left in the buffer, waits for the worker thread to finish, and
+// terminates the compressed stream. Flushing the stream (which calls
+// sync()) makes the worker thread write out everything queued so far
+// without terminating the stream.
+//
+// Errors that happen on the worker thread, be it in the compression
+// library or when writing to the file, cannot be thrown there: an
+// exception that leaves a std::thread terminates the program. The worker
+// thread therefore stores the exception, drops all further chunks, and
+// overflow() and sync() report the error to the stream the usual way,
+// so that the stream's state becomes bad. close() throws the exception
+// itself. The destructor closes the file if this has not happened yet,
+// but since destructors of streams must not throw, it can only print the
+// error.
+class CompressingStreamBuffer : public std::streambuf
+{
+public:
+  CompressingStreamBuffer (const std::string       &filename,
+                           const OutputCompression  compression);
+  ~CompressingStreamBuffer ();
+
+  void close ();
+
+protected:
+  virtual int_type overflow (int_type ch);
+  virtual int      sync ();
+
+private:
+  enum FlushMode
+  {
+    continue_stream,
+    flush_stream,
+    end_stream
+  };
+
+  bool queue_buffer ();
+  void compress_queued_chunks ();
+  void compress (const char        *data,
+                 const std::size_t  n_bytes,
+                 const FlushMode    flush_mode);
+  void write_compressed (const std::size_t n_bytes);
+
+  static const std::size_t  chunk_size        = 1 << 20;
+  static const unsigned int max_queued_chunks = 4;
+
+  const std::string              filename;
+  const OutputCompression        compression;
+  std::ofstream                  file;
+  std::vector<char>              buffer;
+  std::vector<char>              compressed_buffer;
+
+  // The queue of chunks to be compressed. An empty chunk asks the worker
+  // thread to flush the compressed stream to the file; the two counters
+  // allow sync() to wait until this has happened.
+  std::deque<std::vector<char> > queue;
+  std::size_t                    n_chunks_queued;
+  std::size_t                    n_chunks_processed;
+  bool                           all_chunks_queued;
+  std::exception_ptr             worker_error;
+  std::mutex                     queue_mutex;
+  std::condition_variable        queue_changed;
+  std::thread                    worker;
+
+#ifdef DEAL_II_WITH_ZLIB
+  z_stream                       zlib_stream;
+#endif
+#ifdef RING_REFINEMENT_WITH_ZSTD
+  ZSTD_CCtx                     *zstd_context;
+#endif
+};
+
+
+
+CompressingStreamBuffer::
+CompressingStreamBuffer (const std::string       &filename,
+                         const OutputCompression  compression)
+  :
+  filename (filename),
+  compression (compression),
+  file (filename.c_str(), std::ios::binary),
+  buffer (chunk_size),
+  compressed_buffer (chunk_size),
+  n_chunks_queued (0),
+  n_chunks_processed (0),
+  all_chunks_queued (false)
+{
+  AssertThrow (file, ExcMessage ("Could not open output file <"
+                                 + filename + ">."));
+
+  switch (compression)
+    {
+    case OutputCompression::gzip:
+    {
+#ifdef DEAL_II_WITH_ZLIB
+      zlib_stream.zalloc = Z_NULL;
+      zlib_stream.zfree  = Z_NULL;
+      zlib_stream.opaque = Z_NULL;
+      // A window size of 15+16 asks zlib for a gzip header and trailer
+      // instead of a raw zlib stream, so that the result can be read by
+      // gunzip:
+      const int ierr = deflateInit2 (&zlib_stream, Z_DEFAULT_COMPRESSION,
+                                     Z_DEFLATED, 15+16, 8,
+                                     Z_DEFAULT_STRATEGY);
+      AssertThrow (ierr == Z_OK, ExcMessage ("Could not initialize zlib."));
+#else
+      AssertThrow (false,
+                   ExcMessage ("gzip output requires deal.II to be "
+                               "configured with zlib."));
+#endif
+      break;
+    }
+
+    case OutputCompression::zstd:
+    {
+#ifdef RING_REFINEMENT_WITH_ZSTD
+      zstd_context = ZSTD_createCCtx ();
+      AssertThrow (zstd_context != nullptr,
+                   ExcMessage ("Could not initialize zstd."));
+#else
+      AssertThrow (false,
+                   ExcMessage ("zstd output requires the zstd library, "
+                               "which was not found when configuring this "
+                               "program."));
+#endif
+      break;
+    }
+
+    default:
+      Assert (false, ExcNotImplemented());
+    }
+
+  setp (buffer.data(), buffer.data() + buffer.size());
+  worker = std::thread (&CompressingStreamBuffer::compress_queued_chunks,
+                        this);
+}
+
+
+
+CompressingStreamBuffer::~CompressingStreamBuffer ()
+{
+  try
+    {
+      close ();
+    }
+  catch (const std::exception &exc)
+    {
+      std::cerr << "Error while writing <" << filename << ">: "
+                << exc.what() << std::endl;
+    }
+}
+
+
+
+void CompressingStreamBuffer::close ()
+{
+  if (!worker.joinable())
+    return;
+
+  queue_buffer ();
+  {
+    std::lock_guard<std::mutex> lock (queue_mutex);
+    all_chunks_queued = true;
+  }
+  queue_changed.notify_all ();
+  worker.join ();
+
+#ifdef DEAL_II_WITH_ZLIB
+  if (compression == OutputCompression::gzip)
+    deflateEnd (&zlib_stream);
+#endif
+#ifdef RING_REFINEMENT_WITH_ZSTD
+  if (compression == OutputCompression::zstd)
+    ZSTD_freeCCtx (zstd_context);
+#endif
+
+  if (worker_error)
+    std::rethrow_exception (worker_error);
+  file.close ();
+  AssertThrow (file, ExcMessage ("Could not write output file <"
+                                 + filename + ">."));
+}
+
+
+
+CompressingStreamBuffer::int_type
+CompressingStreamBuffer::overflow (int_type ch)
+{
+  if (!queue_buffer ())
+    return traits_type::eof();
+
+  if (!traits_type::eq_int_type (ch, traits_type::eof()))
+    {
+      *pptr() = traits_type::to_char_type (ch);
+      pbump (1);
+    }
+  return traits_type::not_eof (ch);
+}
+
+
+
+// Move the current content of the buffer into the queue, waiting if the
+// queue is full, and start over with an empty buffer. The return value
+// tells whether the worker thread is still able to write the data:
+bool CompressingStreamBuffer::queue_buffer ()
+{
+  if (pptr() == pbase())
+    {
+      std::lock_guard<std::mutex> lock (queue_mutex);
+      return !worker_error;
+    }
+
+  std::vector<char> chunk (pbase(), pptr());
+  setp (buffer.data(), buffer.data() + buffer.size());
+  {
+    std::unique_lock<std::mutex> lock (queue_mutex);
+    queue_changed.wait (lock,
+                        [this] ()
+    {
+      return queue.size() < max_queued_chunks;
+    });
+    if (worker_error)
+      return false;
+    queue.push_back (std::move (chunk));
+    ++n_chunks_queued;
+  }
+  queue_changed.notify_all ();
+  return true;
+}
+
+
+
+// Flushing queues the buffer followed by an empty chunk, and waits until
+// the worker thread has processed both:
+int CompressingStreamBuffer::sync ()
+{
+  if (!worker.joinable() || !queue_buffer ())
+    return -1;
+
+  {
+    std::unique_lock<std::mutex> lock (queue_mutex);
+    queue_changed.wait (lock,
+                        [this] ()
+    {
+      return queue.size() < max_queued_chunks;
+    });
+    queue.push_back (std::vector<char>());
+    ++n_chunks_queued;
+    queue_changed.notify_all ();
+
+    queue_changed.wait (lock,
+                        [this] ()
+    {
+      return n_chunks_processed == n_chunks_queued;
+    });
+    return (worker_error ? -1 : 0);
+  }
+}
+
+
+
+// This is the function that runs on the worker thread. It takes chunks out
+// of the queue until close() has told it that no more will come, and then
+// terminates the compressed stream. Once something went wrong, it only
+// takes chunks out of the queue so that nobody waits for it forever:
+void CompressingStreamBuffer::compress_queued_chunks ()
+{
+  trace_recorder.name_this_thread ("compression");
+  bool failed = false;
+  while (true)
+    {
+      std::vector<char> chunk;
+      {
+        std::unique_lock<std::mutex> lock (queue_mutex);
+        queue_changed.wait (lock,
+                            [this] ()
+        {
+          return (!queue.empty() || all_chunks_queued);
+        });
+        if (queue.empty())
+          break;
+
+        chunk.swap (queue.front());
+        queue.pop_front ();
+      }
+      queue_changed.notify_all ();
+
+      if (!failed)
+        try
+          {
+            TraceScope trace_scope ("compress chunk");
+            if (chunk.empty())
+              {
+                compress (nullptr, 0, flush_stream);
+                file.flush ();
+                AssertThrow (file, ExcMessage ("Could not write output file <"
+                                               + filename + ">."));
+              }
+            else
+              compress (chunk.data(), chunk.size(), continue_stream);
+          }
+        catch (...)
+          {
+            std::lock_guard<std::mutex> lock (queue_mutex);
+            worker_error = std::current_exception ();
+            failed       = true;
+          }
+
+      {
+        std::lock_guard<std::mutex> lock (queue_mutex);
+        ++n_chunks_processed;
+      }
+      queue_changed.notify_all ();
+    }
+
+  if (!failed)
+    try
+      {
+        compress (nullptr, 0, end_stream);
+        file.flush ();
+      }
+    catch (...)
+      {
+        std::lock_guard<std::mutex> lock (queue_mutex);
+        worker_error = std::current_exception ();
+      }
+}
+
+
+
+// Finally the actual compression. Both libraries work the same way: we
+// give them the input and a fixed-size output buffer, and write out
+// whatever they produced until they have consumed all of the input (and,
+// when flushing or at the end, until they have flushed their internal
+// state). zlib reports Z_BUF_ERROR if it could not make progress, which is
+// not an error when there was nothing left to do:
+void CompressingStreamBuffer::write_compressed (const std::size_t n_bytes)
+{
+  file.write (compressed_buffer.data(), n_bytes);
+  AssertThrow (file, ExcMessage ("Could not write output file <"
+                                 + filename + ">."));
+}
+
+
+
+void CompressingStreamBuffer::compress (const char        *data,
+                                        const std::size_t  n_bytes,
+                                        const FlushMode    flush_mode)
+{
+  switch (compression)
+    {
+#ifdef DEAL_II_WITH_ZLIB
+    case OutputCompression::gzip:
+    {
+      zlib_stream.next_in  = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+      zlib_stream.avail_in = n_bytes;
+      do
+        {
+          zlib_stream.next_out
+            = reinterpret_cast<Bytef *>(compressed_buffer.data());
+          zlib_stream.avail_out = compressed_buffer.size();
+          const int ierr
+            = deflate (&zlib_stream,
+                       (flush_mode == end_stream   ? Z_FINISH :
+                        flush_mode == flush_stream ? Z_SYNC_FLUSH :
+                        Z_NO_FLUSH));
+          AssertThrow ((ierr == Z_OK) || (ierr == Z_STREAM_END)
+                       || (ierr == Z_BUF_ERROR),
+                       ExcMessage ("zlib failed to compress <"
+                                   + filename + ">."));
+          write_compressed (compressed_buffer.size() - zlib_stream.avail_out);
+        }
+      while (zlib_stream.avail_out == 0);
+      break;
+    }
+#endif
+
+#ifdef RING_REFINEMENT_WITH_ZSTD
+    case OutputCompression::zstd:
+    {
+      ZSTD_inBuffer input = { data, n_bytes, 0 };
+      bool          done  = false;
+      do
+        {
+          ZSTD_outBuffer output = { compressed_buffer.data(),
+                                    compressed_buffer.size(), 0
+                                  };
+          const std::size_t remaining
+            = ZSTD_compressStream2 (zstd_context, &output, &input,
+                                    (flush_mode == end_stream   ? ZSTD_e_end :
+                                     flush_mode == flush_stream ? ZSTD_e_flush :
+                                     ZSTD_e_continue));
+          AssertThrow (!ZSTD_isError (remaining),
+                       ExcMessage (ZSTD_getErrorName (remaining)));
+          write_compressed (output.pos);
+
+          done = (flush_mode == continue_stream ?
+                  (input.pos == input.size) :
+                  (remaining == 0));
+        }
+      while (!done);
+      break;
+    }
+#endif
+
+    default:
+      Assert (false, ExcNotImplemented());
+    }
+}
+
+
+
+// The stream class that owns such a buffer. Because base classes are
+// constructed before members, we have to attach the buffer to the stream
+// after the fact:
+class CompressedOutputStream : public std::ostream
+{
+public:
+  CompressedOutputStream (const std::string       &filename,
+                          const OutputCompression  compression)
+    :
+    std::ostream (nullptr),
+    stream_buffer (filename, compression)
+  {
+    rdbuf (&stream_buffer);
+  }
+
+  void close ()
+  {
+    stream_buffer.close ();
+  }
+
+private:
+  CompressingStreamBuffer stream_buffer;
+};
+
+
+
+// With all of this, opening an output file becomes a matter of looking at
+// the file name: plain files are written through a std::ofstream as
+// before, everything else through the pipeline above.
+std::unique_ptr<std::ostream>
+open_output_file (const std::string &filename)
+{
+  const OutputCompression compression = compression_from_file_name (filename);
+
+  if (compression == OutputCompression::none)
+    {
+      std::unique_ptr<std::ostream> out (new std::ofstream (filename.c_str()));
+      AssertThrow (*out, ExcMessage ("Could not open output file <"
+                                     + filename + ">."));
+      return out;
+    }
+  else
+    return std::unique_ptr<std::ostream>
+           (new CompressedOutputStream (filename, compression));
+}
+
+
+
+// Whether writing succeeded is only known once the file is closed:
+// std::ofstream may keep the last bytes in its buffer, and a compressed
+// stream may hold on to even more. Functions that write files obtained
+// from open_output_file() therefore close them with the following
+// function, which throws an exception if anything went wrong:
+void close_output_file (std::ostream &out)
+{
+  if (CompressedOutputStream *compressed_out
+      = dynamic_cast<CompressedOutputStream *>(&out))
+    compressed_out->close ();
+  else
+    out.flush ();
+
+  AssertThrow (out, ExcMessage ("An error occurred while writing an "
+                                "output file."));
+}
+
+
+
+// @sect3{Writing grids in different formats}
+
+// The EPS files written by GridOut::write_eps() are good for looking at a
+// mesh, but programs that want to compute on it need formats that contain
+// the connectivity and the boundary and manifold indicators. The
+// following functions write two such formats, AVS UCD and Gmsh's MSH
+// format (version 2.2), and write_grid() below writes a mesh in all
+// formats requested on the command line.
+//
+// When running on several processes (see the section on this below), each
+// process writes only the cells of its own subdomain. The functions in this
+// section therefore take an optional subdomain id; if it is given, only
+// cells with this subdomain id are written, and the default writes all
+// cells. The functions that mark cells and check the quality of the mesh
+// further down use the same test:
+bool is_in_subdomain (const Triangulation<2>::active_cell_iterator &cell,
+                      const types::subdomain_id                     subdomain)
+{
+  return ((subdomain == numbers::invalid_subdomain_id)
+          || (cell->subdomain_id() == subdomain));
+}
+
+
+
+// Both writers number the vertices in use consecutively (the triangulation
+// may have unused vertices, for example after coarsening), starting at one
+// as both formats require. If only one subdomain is written, the vertices in
+// use are those of its cells:
+std::vector<int>
+number_used_vertices (const Triangulation<2>  &triangulation,
+                      unsigned int            &n_used_vertices,
+                      const types::subdomain_id subdomain = numbers::invalid_subdomain_id)
+{
+  std::vector<bool> used_vertices = triangulation.get_used_vertices();
+  if (subdomain != numbers::invalid_subdomain_id)
+    {
+      used_vertices.assign (used_vertices.size(), false);
+      for (Triangulation<2>::active_cell_iterator
+           cell = triangulation.begin_active();
+           cell != triangulation.end(); ++cell)
+        if (is_in_subdomain (cell, subdomain))
+          for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+            used_vertices[cell->vertex_index(v)] = true;
+    }
+
+  std::vector<int> vertex_numbers (used_vertices.size(), 0);
+  n_used_vertices = 0;
+  for (unsigned int v=0; v<used_vertices.size(); ++v)
+    if (used_vertices[v])
+      vertex_numbers[v] = ++n_used_vertices;
+  return vertex_numbers;
+}
+
+
+
+// Both formats also list the boundary faces of the mesh as separate
+// elements, and we need to know how many there are before we write them:
+unsigned int
+count_boundary_faces (const Triangulation<2>  &triangulation,
+                      const types::subdomain_id subdomain = numbers::invalid_subdomain_id)
+{
+  unsigned int n_boundary_faces = 0;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (is_in_subdomain (cell, subdomain))
+      for (unsigned int f=0; f<GeometryInfo<2>::faces_per_cell; ++f)
+        if (cell->at_boundary(f))
+          ++n_boundary_faces;
+  return n_boundary_faces;
+}
+
+
+
+// deal.II numbers the vertices of a quadrilateral lexicographically,
+// whereas both formats list them counter-clockwise:
+const unsigned int counter_clockwise_vertices[4] = { 0, 1, 3, 2 };
+
+
+
+// @sect4{Formatting text on several threads}
+
+// Converting numbers to text is what takes most of the time when writing a
+// large mesh in a text format, and it can be done for different parts of
+// the file at the same time. The following function writes
+// <code>n_items</code> items (vertices, cells, or faces) whose text
+// <code>write_item</code> produces: it formats chunks of consecutive items
+// into strings on separate tasks, and then writes these strings to the
+// stream in order. So as not to hold the text of the whole file in memory,
+// it only formats a few chunks per thread at a time. Each chunk uses the
+// number format of the output stream.
+void write_in_chunks (std::ostream                                                 &out,
+                      const unsigned int                                            n_items,
+                      const std::function<void (const unsigned int, std::ostream &)> &write_item)
+{
+  const unsigned int chunk_size = 4096;
+  const unsigned int n_chunks   = (n_items + chunk_size - 1) / chunk_size;
+  const unsigned int window     = 4 * MultithreadInfo::n_threads();
+
+  std::vector<std::string> chunks (std::min (window, n_chunks));
+  for (unsigned int first=0; first<n_chunks; first+=window)
+    {
+      const unsigned int last = std::min (first+window, n_chunks);
+
+      Threads::TaskGroup<void> tasks;
+      for (unsigned int c=first; c<last; ++c)
+        tasks += Threads::new_task (std::function<void ()> ([&, c] ()
+        {
+          std::ostringstream chunk;
+          chunk.flags (out.flags());
+          chunk.precision (out.precision());
+          for (unsigned int i=c*chunk_size; i<std::min ((c+1)*chunk_size, n_items); ++i)
+            write_item (i, chunk);
+          chunks[c-first] = chunk.str();
+        }));
+      tasks.join_all ();
+
+      for (unsigned int c=first; c<last; ++c)
+        out << chunks[c-first];
+    }
+}
+
+
+
+// @sect4{UCD output}
+
+// UCD is a text format. After a header line with the numbers of nodes,
+// elements, and data fields, it lists the nodes and then the elements,
+// where boundary faces are elements of type "line" whose material id is
+// the boundary indicator. GridOut::write_ucd() can write this as well,
+// but has no place for manifold indicators. We therefore add a section of
+// cell data with three fields for every element: the material or boundary
+// indicator, the manifold indicator, and the subdomain id (zero for
+// boundary faces).
+//
+// Each of these sections is written with write_in_chunks(), for which we
+// first collect the vertices, cells, and boundary faces to be written into
+// arrays; the number of an element is then its position in these arrays.
+void write_ucd (const Triangulation<2>  &triangulation,
+                std::ostream            &out,
+                const types::subdomain_id subdomain = numbers::invalid_subdomain_id)
+{
+  unsigned int n_nodes = 0;
+  const std::vector<int> vertex_numbers
+    = number_used_vertices (triangulation, n_nodes, subdomain);
+
+  std::vector<unsigned int> nodes;
+  nodes.reserve (n_nodes);
+  for (unsigned int v=0; v<vertex_numbers.size(); ++v)
+    if (vertex_numbers[v] != 0)
+      nodes.push_back (v);
+
+  std::vector<Triangulation<2>::active_cell_iterator> cells;
+  std::vector<Triangulation<2>::face_iterator>        boundary_faces;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (is_in_subdomain (cell, subdomain))
+      cells.push_back (cell);
+  for (unsigned int c=0; c<cells.size(); ++c)
+    for (unsigned int f=0; f<GeometryInfo<2>::faces_per_cell; ++f)
+      if (cells[c]->at_boundary(f))
+        boundary_faces.push_back (cells[c]->face(f));
+
+  const unsigned int n_cells = cells.size();
+
+  out << "# UCD file written by ring_refinement" << '\n'
+      << n_nodes << ' ' << n_cells + boundary_faces.size() << " 0 3 0" << '\n';
+
+  const std::vector<Point<2> > &vertices = triangulation.get_vertices();
+  write_in_chunks (out, nodes.size(),
+                   [&] (const unsigned int i, std::ostream &chunk)
+  {
+    const Point<2> &vertex = vertices[nodes[i]];
+    chunk << i+1 << ' ' << vertex[0] << ' ' << vertex[1] << " 0" << '\n';
+  });
+
+  write_in_chunks (out, n_cells,
+                   [&] (const unsigned int i, std::ostream &chunk)
+  {
+    chunk << i+1 << ' ' << static_cast<unsigned int>(cells[i]->material_id())
+          << " quad";
+    for (unsigned int v=0; v<4; ++v)
+      chunk << ' '
+            << vertex_numbers[cells[i]->vertex_index(counter_clockwise_vertices[v])];
+    chunk << '\n';
+  });
+  write_in_chunks (out, boundary_faces.size(),
+                   [&] (const unsigned int i, std::ostream &chunk)
+  {
+    chunk << n_cells+i+1 << ' '
+          << static_cast<unsigned int>(boundary_faces[i]->boundary_id())
+          << " line "
+          << vertex_numbers[boundary_faces[i]->vertex_index(0)] << ' '
+          << vertex_numbers[boundary_faces[i]->vertex_index(1)] << '\n';
+  });
+
+  // The cell data section, in the same order of elements as above. The
+  // flat manifold indicator, numbers::flat_manifold_id, is written as -1:
+  out << "3 1 1 1" << '\n'
+      << "boundary_or_material_id, none" << '\n'
+      << "manifold_id, none" << '\n'
+      << "subdomain_id, none" << '\n';
+  write_in_chunks (out, n_cells,
+                   [&] (const unsigned int i, std::ostream &chunk)
+  {
+    chunk << i+1 << ' '
+          << static_cast<unsigned int>(cells[i]->material_id()) << ' '
+          << static_cast<int>(cells[i]->manifold_id()) << ' '
+          << cells[i]->subdomain_id() << '\n';
+  });
+  write_in_chunks (out, boundary_faces.size(),
+                   [&] (const unsigned int i, std::ostream &chunk)
+  {
+    chunk << n_cells+i+1 << ' '
+          << static_cast<unsigned int>(boundary_faces[i]->boundary_id()) << ' '
+          << static_cast<int>(boundary_faces[i]->manifold_id()) << " 0" << '\n';
+  });
+
+  out.flush ();
+}
+
+
+
+// @sect4{Binary MSH output}
+
+// Most of the time spent writing a large mesh in a text format goes into
+// converting numbers to text. The MSH format also has a binary variant, in
+// which the node coordinates and the element connectivity are stored as
+// raw <code>int</code> and <code>double</code> values; the file can then
+// be written with a few large calls to <code>std::ostream::write()</code>.
+// The following class collects such values in a buffer and writes it out
+// whenever it has grown to <code>capacity</code> bytes, so that the
+// memory needed does not grow with the size of the mesh:
+class BinaryBlockWriter
+{
+public:
+  BinaryBlockWriter (std::ostream &out)
+    :
+    out (out)
+  {
+    buffer.reserve (capacity);
+  }
+
+  ~BinaryBlockWriter ()
+  {
+    flush ();
+  }
+
+  template <typename T>
+  void append (const T &value)
+  {
+    const char *bytes = reinterpret_cast<const char *>(&value);
+    buffer.insert (buffer.end(), bytes, bytes+sizeof(T));
+    if (buffer.size() >= capacity)
+      flush ();
+  }
+
+  void flush ()
+  {
+    out.write (buffer.data(), buffer.size());
+    buffer.clear ();
+  }
+
+private:
+  static const std::size_t capacity = 1 << 20;
+
+  std::ostream      &out;
+  std::vector<char>  buffer;
+};
+
+
+
+// In the binary MSH format, the header and the section markers are still
+// text, followed by the integer 1 written in binary so that readers can
+// detect the byte order. Nodes are stored as the node number followed by
+// three coordinates. Elements are stored in blocks of equal type, each
+// starting with three integers: the element type (1 for two-node lines, 3
+// for four-node quadrilaterals), the number of elements in the block, and
+// the number of tags per element. We write boundary faces with two tags,
+// the boundary indicator as "physical" tag and the manifold indicator as
+// "elementary" tag (again using -1 for flat manifolds). Cells have two
+// more tags, the number of partitions the element belongs to (always one)
+// and its partition, which is the subdomain id plus one since Gmsh counts
+// partitions starting at one. As for UCD output, a subdomain id restricts
+// the output to the cells of this subdomain, their vertices, and their
+// boundary faces.
+void write_msh_binary (const Triangulation<2>  &triangulation,
+                       std::ostream            &out,
+                       const types::subdomain_id subdomain = numbers::invalid_subdomain_id)
+{
+  unsigned int n_nodes = 0;
+  const std::vector<int> vertex_numbers
+    = number_used_vertices (triangulation, n_nodes, subdomain);
+  const unsigned int n_boundary_faces = count_boundary_faces (triangulation,
+                                                              subdomain);
+  unsigned int n_cells = 0;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (is_in_subdomain (cell, subdomain))
+      ++n_cells;
+
+  const int one = 1;
+  out << "$MeshFormat\n2.2 1 " << sizeof(double) << '\n';
+  out.write (reinterpret_cast<const char *>(&one), sizeof(one));
+  out << "\n$EndMeshFormat\n";
+
+  out << "$Nodes\n" << n_nodes << '\n';
+  {
+    BinaryBlockWriter writer (out);
+    const std::vector<Point<2> > &vertices = triangulation.get_vertices();
+    for (unsigned int v=0; v<vertices.size(); ++v)
+      if (vertex_numbers[v] != 0)
+        {
+          writer.append (vertex_numbers[v]);
+          writer.append (vertices[v][0]);
+          writer.append (vertices[v][1]);
+          writer.append (0.);
+        }
+  }
+  out << "\n$EndNodes\n";
+
+  out << "$Elements\n" << n_cells + n_boundary_faces << '\n';
+  {
+    BinaryBlockWriter writer (out);
+    int element = 0;
+
+    if (n_boundary_faces > 0)
+      {
+        writer.append (1);
+        writer.append (static_cast<int>(n_boundary_faces));
+        writer.append (2);
+        for (Triangulation<2>::active_cell_iterator
+             cell = triangulation.begin_active();
+             cell != triangulation.end(); ++cell)
+          if (is_in_subdomain (cell, subdomain))
+            for (unsigned int f=0; f<GeometryInfo<2>::faces_per_cell; ++f)
+              if (cell->at_boundary(f))
+                {
+                  writer.append (++element);
+                  writer.append (static_cast<int>(cell->face(f)->boundary_id()));
+                  writer.append (static_cast<int>(cell->face(f)->manifold_id()));
+                  writer.append (vertex_numbers[cell->face(f)->vertex_index(0)]);
+                  writer.append (vertex_numbers[cell->face(f)->vertex_index(1)]);
+                }
+      }
+
+    writer.append (3);
+    writer.append (static_cast<int>(n_cells));
+    writer.append (4);
+    for (Triangulation<2>::active_cell_iterator
+         cell = triangulation.begin_active();
+         cell != triangulation.end(); ++cell)
+      if (is_in_subdomain (cell, subdomain))
+        {
+          writer.append (++element);
+          writer.append (static_cast<int>(cell->material_id()));
+          writer.append (static_cast<int>(cell->manifold_id()));
+          writer.append (1);
+          writer.append (static_cast<int>(cell->subdomain_id()) + 1);
+          for (unsigned int i=0; i<4; ++i)
+            writer.append
+            (vertex_numbers[cell->vertex_index(counter_clockwise_vertices[i])]);
+        }
+  }
+  out << "\n$EndElements\n";
+  out.flush ();
+}
+
+
+
+// @sect4{Writing a grid in all requested formats}
+
+// Finally, the function that the rest of the program uses to write a mesh.
+// It writes one file per format listed on the command line (by default
+// only EPS), named after the given base name, the usual extension of the
+// format, and the suffix that selects compression. EPS output is done by
+// the GridOut class of deal.II, which can write a number of different
+// graphics formats; the other two formats by the functions above.
+void write_grid (const Triangulation<2> &triangulation,
+                 const std::string      &base_name,
+                 const ProgramOptions   &options)
+{
+  TraceScope trace_scope ("write grid");
+  for (unsigned int i=0; i<options.output_formats.size(); ++i)
+    {
+      const std::string &format = options.output_formats[i];
+      const std::string  extension = (format == "ucd" ? "inp" : format);
+      const std::string  filename = base_name + "." + extension
+                                    + options.output_suffix;
+
+      {
+        const std::unique_ptr<std::ostream> out = open_output_file (filename);
+        if (format == "eps")
+          {
+            GridOut grid_out;
+            grid_out.write_eps (triangulation, *out);
+          }
+        else if (format == "ucd")
+          write_ucd (triangulation, *out);
+        else if (format == "msh")
+          write_msh_binary (triangulation, *out);
+        else
+          AssertThrow (false, ExcMessage ("Unknown output format <"
+                                          + format + ">."));
+        close_output_file (*out);
+      }
+      std::cout << "Grid written to " << filename << std::endl;
+    }
+}
+
+
+
+// @sect3{Reading large meshes}
+
+// Instead of generating the coarse mesh with one of the functions in
+// GridGenerator, one can also read it from a file. deal.II's GridIn class
+// does this, but it reads the file through a std::istream one number at a
+// time on a single thread, which for meshes with millions of cells takes
+// longer than everything else this program does. The functions in this
+// section read Gmsh (MSH version 2.2, in text or binary form) and UCD
+// files faster: the file is mapped into memory, and the sections that list
+// the vertices and cells are cut into pieces at line boundaries that are
+// then converted from text to numbers on separate tasks.
+//
+// The following class maps a file into memory for reading, and unmaps it
+// when it is destroyed:
+class MappedFile
+{
+public:
+  MappedFile (const std::string &filename);
+  ~MappedFile ();
+
+  const char *begin () const
+  {
+    return data;
+  }
+
+  const char *end () const
+  {
+    return data + size;
+  }
+
+private:
+  int          file_descriptor;
+  std::size_t  size;
+  const char  *data;
+};
+
+
+
+MappedFile::MappedFile (const std::string &filename)
+  :
+  file_descriptor (open (filename.c_str(), O_RDONLY)),
+  size (0),
+  data (nullptr)
+{
+  AssertThrow (file_descriptor >= 0,
+               ExcMessage ("Could not open input file <" + filename + ">."));
+
+  struct stat file_status;
+  AssertThrow ((fstat (file_descriptor, &file_status) == 0)
+               && (file_status.st_size > 0),
+               ExcMessage ("Could not determine the size of input file <"
+                           + filename + ">, or the file is empty."));
+  size = file_status.st_size;
+
+  void *mapping = mmap (nullptr, size, PROT_READ, MAP_PRIVATE,
+                        file_descriptor, 0);
+  AssertThrow (mapping != MAP_FAILED,
+               ExcMessage ("Could not map input file <" + filename
+                           + "> into memory."));
+  data = static_cast<const char *>(mapping);
+
+  // We will read the file front to back:
+  madvise (mapping, size, MADV_SEQUENTIAL);
+}
+
+
+
+MappedFile::~MappedFile ()
+{
+  munmap (const_cast<char *>(data), size);
+  close (file_descriptor);
+}
+
+
+
+// @sect4{Tokenizing}
+
+// The memory we read from is not terminated by a zero character, so we
+// cannot simply call <code>std::strtol</code> and <code>std::strtod</code>
+// on it. The following small functions convert one token at a time and
+// never look past the end of the range they are given. Each takes the
+// current position by reference and advances it past the token.
+inline bool is_whitespace (const char c)
+{
+  return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+
+inline const char *skip_whitespace (const char *p, const char *end)
+{
+  while ((p != end) && is_whitespace (*p))
+    ++p;
+  return p;
+}
+
+
+inline const char *skip_line (const char *p, const char *end)
+{
+  p = static_cast<const char *>(std::memchr (p, '\n', end-p));
+  return (p == nullptr ? end : p+1);
+}
+
+
+inline long read_integer (const char *&p, const char *end)
+{
+  p = skip_whitespace (p, end);
+  const bool negative = ((p != end) && (*p == '-'));
+  if ((p != end) && ((*p == '-') || (*p == '+')))
+    ++p;
+  AssertThrow ((p != end) && std::isdigit (static_cast<unsigned char>(*p)),
+               ExcMessage ("Expected an integer in the input file."));
+
+  long value = 0;
+  while ((p != end) && std::isdigit (static_cast<unsigned char>(*p)))
+    value = 10*value + (*p++ - '0');
+  return (negative ? -value : value);
+}
+
+
+inline double read_double (const char *&p, const char *end)
+{
+  p = skip_whitespace (p, end);
+  char token[64];
+  unsigned int length = 0;
+  while ((p != end) && !is_whitespace (*p) && (length < sizeof(token)-1))
+    token[length++] = *p++;
+  token[length] = '\0';
+
+  char *token_end;
+  const double value = std::strtod (token, &token_end);
+  AssertThrow ((length > 0) && (token_end == token+length),
+               ExcMessage ("Expected a floating point number in the input "
+                           "file, but found <" + std::string (token) + ">."));
+  return value;
+}
+
+
+inline std::string read_word (const char *&p, const char *end)
+{
+  p = skip_whitespace (p, end);
+  const char *word_begin = p;
+  while ((p != end) && !is_whitespace (*p))
+    ++p;
+  return std::string (word_begin, p);
+}
+
+
+
+// The records we read from either format. Elements are cells (four
+// vertices), boundary faces (two vertices), or something we ignore, such
+// as the points Gmsh writes for the corners of the geometry (zero
+// vertices). The tag is the material id of a cell or the boundary id of a
+// face.
+struct ImportedNode
+{
+  long     id;
+  Point<2> position;
+};
+
+
+struct ImportedElement
+{
+  unsigned int n_vertices;
+  long         vertices[4];
+  long         tag;
+};
+
+
+
+// The following function does the parallel part of the work: given a range
+// of the file that contains one record per line, it cuts the range into
+// pieces that start at the beginning of a line, parses each piece into a
+// vector of records on a task of its own, and concatenates the results in
+// order.
+//
+// The functions that parse a record throw an exception if the line is not
+// what they expect. An exception that leaves a task would end the program
+// right away, without the message that main() prints for errors, so each
+// task catches it and we throw it again once all tasks have finished (the
+// first one, if there are several).
+template <typename Record>
+std::vector<Record>
+parse_lines_in_parallel
+(const char                                                 *begin,
+ const char                                                 *end,
+ const std::function<Record (const char *&, const char *)>  &parse_record)
+{
+  const std::size_t min_chunk_size = 1 << 16;
+  const unsigned int n_chunks
+    = std::max<std::size_t> (1,
+                             std::min<std::size_t> (4 * MultithreadInfo::n_threads(),
+                                                    (end - begin) / min_chunk_size));
+
+  std::vector<const char *> chunk_begin (n_chunks+1, end);
+  chunk_begin[0] = begin;
+  for (unsigned int c=1; c<n_chunks; ++c)
+    {
+      const char *p = begin + (end - begin) * c / n_chunks;
+      if (*(p-1) != '\n')
+        p = skip_line (p, end);
+      chunk_begin[c] = std::max (p, chunk_begin[c-1]);
+    }
+
+  std::vector<std::vector<Record> > chunk_records (n_chunks);
+  std::vector<std::exception_ptr>   chunk_errors (n_chunks);
+  Threads::TaskGroup<void> tasks;
+  for (unsigned int c=0; c<n_chunks; ++c)
+    tasks += Threads::new_task (std::function<void ()> ([&, c] ()
+    {
+      TraceScope trace_scope ("parse lines");
+      try
+        {
+          const char *p = chunk_begin[c];
+          const char *const chunk_end = chunk_begin[c+1];
+          while ((p = skip_whitespace (p, chunk_end)) != chunk_end)
+            {
+              chunk_records[c].push_back (parse_record (p, chunk_end));
+              p = skip_line (p, chunk_end);
+            }
+        }
+      catch (...)
+        {
+          chunk_errors[c] = std::current_exception ();
+        }
+    }));
+  tasks.join_all ();
+
+  for (unsigned int c=0; c<n_chunks; ++c)
+    if (chunk_errors[c])
+      std::rethrow_exception (chunk_errors[c]);
+
+  std::vector<Record> records;
+  std::size_t n_records = 0;
+  for (unsigned int c=0; c<n_chunks; ++c)
+    n_records += chunk_records[c].size();
+  records.reserve (n_records);
+  for (unsigned int c=0; c<n_chunks; ++c)
+    records.insert (records.end(),
+                    chunk_records[c].begin(), chunk_records[c].end());
+  return records;
+}
+
+
+
+// @sect4{Reading Gmsh files}
+
+// A Gmsh file consists of sections enclosed in lines such as
+// <code>$Nodes</code> and <code>$EndNodes</code>. The following function
+// returns the range between the line following the start marker and the
+// end marker:
+std::pair<const char *, const char *>
+find_section (const char        *begin,
+              const char        *end,
+              const std::string &name)
+{
+  const std::string start_marker = "$" + name,
+                    end_marker   = "$End" + name;
+
+  const char *section_begin = std::search (begin, end,
+                                           start_marker.begin(),
+                                           start_marker.end());
+  AssertThrow (section_begin != end,
+               ExcMessage ("The input file has no " + start_marker
+                           + " section."));
+  section_begin = skip_line (section_begin, end);
+
+  const char *section_end = std::search (section_begin, end,
+                                         end_marker.begin(),
+                                         end_marker.end());
+  AssertThrow (section_end != end,
+               ExcMessage ("The input file has no " + end_marker
+                           + " marker."));
+  return std::make_pair (section_begin, section_end);
+}
+
+
+
+// The number of vertices of the Gmsh element types we know about: lines
+// (type 1) become boundary faces, quadrilaterals (type 3) cells, and points
+// (type 15) are ignored. Everything else, such as triangles, cannot be
+// represented by a deal.II triangulation of quadrilaterals.
+unsigned int gmsh_element_vertices (const long element_type)
+{
+  switch (element_type)
+    {
+    case 1:
+      return 2;
+    case 3:
+      return 4;
+    case 15:
+      return 1;
+    default:
+      AssertThrow (false,
+                   ExcMessage ("Gmsh element type "
+                               + Utilities::int_to_string (element_type)
+                               + " is not supported."));
+      return 0;
+    }
+}
+
+
+
+// In the text form of the format, each node is a line with its number and
+// three coordinates, and each element a line with its number, its type,
+// the number of tags, the tags (of which the first is the "physical" tag
+// that we use as material or boundary id), and the node numbers. In the
+// binary form (as written by write_msh_binary() above), the same values
+// are stored as raw integers and doubles, and there is nothing to
+// tokenize; we simply copy them out of the file. Since the numbers of
+// values to copy come from the file itself, we check before each copy that
+// they do not reach past the end of the section, so that a truncated or
+// corrupted file leads to an error rather than to reading whatever follows
+// in memory.
+void read_msh (const MappedFile               &file,
+               std::vector<ImportedNode>      &nodes,
+               std::vector<ImportedElement>   &elements)
+{
+  const std::pair<const char *, const char *> format
+    = find_section (file.begin(), file.end(), "MeshFormat");
+  const char *p = format.first;
+  const double version     = read_double (p, format.second);
+  const long   binary      = read_integer (p, format.second);
+  const long   double_size = read_integer (p, format.second);
+  AssertThrow ((version >= 2) && (version < 3)
+               && (double_size == sizeof(double)),
+               ExcMessage ("Only version 2 of the MSH format is supported."));
+  if (binary)
+    {
+      p = skip_line (p, format.second);
+      AssertThrow (format.second - p >= static_cast<long>(sizeof(int)),
+                   ExcMessage ("The $MeshFormat section of the binary MSH "
+                               "file is too short."));
+      int one;
+      std::memcpy (&one, p, sizeof(one));
+      AssertThrow (one == 1,
+                   ExcMessage ("The binary MSH file has a different byte "
+                               "order than this machine."));
+    }
+
+  const std::pair<const char *, const char *> node_section
+    = find_section (file.begin(), file.end(), "Nodes");
+  p = node_section.first;
+  const long n_nodes = read_integer (p, node_section.second);
+  p = skip_line (p, node_section.second);
+  AssertThrow (n_nodes >= 0,
+               ExcMessage ("The MSH file has a negative number of nodes."));
+
+  if (!binary)
+    nodes = parse_lines_in_parallel<ImportedNode>
+            (p, node_section.second,
+             [] (const char *&q, const char *end)
+    {
+      ImportedNode node;
+      node.id          = read_integer (q, end);
+      node.position[0] = read_double (q, end);
+      node.position[1] = read_double (q, end);
+      return node;
+    });
+  else
+    {
+      const std::size_t node_size = sizeof(int) + 3*sizeof(double);
+      AssertThrow (node_section.second - p >= static_cast<long>(n_nodes * node_size),
+                   ExcMessage ("The $Nodes section of the binary MSH file is "
+                               "too short."));
+      nodes.resize (n_nodes);
+      for (long n=0; n<n_nodes; ++n, p+=node_size)
+        {
+          int    id;
+          double coordinates[3];
+          std::memcpy (&id, p, sizeof(id));
+          std::memcpy (coordinates, p+sizeof(id), sizeof(coordinates));
+          nodes[n].id       = id;
+          nodes[n].position = Point<2> (coordinates[0], coordinates[1]);
+        }
+    }
+  AssertThrow (static_cast<long>(nodes.size()) == n_nodes,
+               ExcMessage ("The number of nodes in the MSH file does not "
+                           "match the number given in its header."));
+
+  const std::pair<const char *, const char *> element_section
+    = find_section (file.begin(), file.end(), "Elements");
+  p = element_section.first;
+  const long n_elements = read_integer (p, element_section.second);
+  p = skip_line (p, element_section.second);
+  AssertThrow (n_elements >= 0,
+               ExcMessage ("The MSH file has a negative number of elements."));
+
+  if (!binary)
+    elements = parse_lines_in_parallel<ImportedElement>
+               (p, element_section.second,
+                [] (const char *&q, const char *end)
+    {
+      ImportedElement element;
+      read_integer (q, end);
+      const unsigned int n_vertices
+        = gmsh_element_vertices (read_integer (q, end));
+      const long n_tags = read_integer (q, end);
+      element.tag = 0;
+      for (long t=0; t<n_tags; ++t)
+        {
+          const long tag = read_integer (q, end);
+          if (t == 0)
+            element.tag = tag;
+        }
+      for (unsigned int v=0; v<n_vertices; ++v)
+        element.vertices[std::min (v, 3u)] = read_integer (q, end);
+      element.n_vertices = (n_vertices == 1 ? 0 : n_vertices);
+      return element;
+    });
+  else
+    {
+      const auto check_remaining_size = [&] (const std::size_t n_bytes)
+      {
+        AssertThrow (element_section.second - p >= static_cast<long>(n_bytes),
+                     ExcMessage ("The $Elements section of the binary MSH "
+                                 "file is too short."));
+      };
+
+      // Every element takes at least four integers, which bounds how many
+      // elements the section can hold no matter what its header says:
+      elements.reserve (std::min<long> (n_elements,
+                                        (element_section.second - p)
+                                        / (4*sizeof(int))));
+      while (static_cast<long>(elements.size()) < n_elements)
+        {
+          int header[3];
+          check_remaining_size (sizeof(header));
+          std::memcpy (header, p, sizeof(header));
+          p += sizeof(header);
+          AssertThrow ((header[1] >= 0) && (header[2] >= 0),
+                       ExcMessage ("The binary MSH file has an element block "
+                                   "with a negative number of elements or "
+                                   "tags."));
+          const unsigned int n_vertices = gmsh_element_vertices (header[0]);
+          const std::size_t  n_values   = 1 + header[2] + n_vertices;
+
+          std::vector<int> values;
+          if (header[1] > 0)
+            {
+              check_remaining_size (n_values*sizeof(int));
+              values.resize (n_values);
+            }
+          for (int e=0; e<header[1]; ++e)
+            {
+              check_remaining_size (n_values*sizeof(int));
+              std::memcpy (values.data(), p, n_values*sizeof(int));
+              p += n_values*sizeof(int);
+
+              ImportedElement element;
+              element.n_vertices = (n_vertices == 1 ? 0 : n_vertices);
+              element.tag = (header[2] > 0 ? values[1] : 0);
+              for (unsigned int v=0; v<element.n_vertices; ++v)
+                element.vertices[v] = values[1+header[2]+v];
+              elements.push_back (element);
+            }
+        }
+    }
+  AssertThrow (static_cast<long>(elements.size()) == n_elements,
+               ExcMessage ("The number of elements in the MSH file does not "
+                           "match the number given in its header."));
+}
+
+
+
+// @sect4{Reading UCD files}
+
+// UCD files have no section markers. After comment lines starting with
+// '#', a header line gives the numbers of nodes and cells, followed by one
+// line for each. To cut the file into the node and cell parts, we have to
+// find the end of the last node line, which <code>std::memchr</code>
+// does much faster than converting the lines would. Anything after the
+// cells, such as the data fields written by write_ucd() above, is ignored.
+void read_ucd (const MappedFile               &file,
+               std::vector<ImportedNode>      &nodes,
+               std::vector<ImportedElement>   &elements)
+{
+  const char *p = file.begin();
+  while ((p = skip_whitespace (p, file.end())) != file.end() && (*p == '#'))
+    p = skip_line (p, file.end());
+
+  const long n_nodes = read_integer (p, file.end());
+  const long n_cells = read_integer (p, file.end());
+  p = skip_line (p, file.end());
+
+  const char *const nodes_begin = p;
+  for (long n=0; n<n_nodes; ++n)
+    p = skip_line (p, file.end());
+  const char *const cells_begin = p;
+  for (long n=0; n<n_cells; ++n)
+    p = skip_line (p, file.end());
+
+  nodes = parse_lines_in_parallel<ImportedNode>
+          (nodes_begin, cells_begin,
+           [] (const char *&q, const char *end)
+  {
+    ImportedNode node;
+    node.id          = read_integer (q, end);
+    node.position[0] = read_double (q, end);
+    node.position[1] = read_double (q, end);
+    return node;
+  });
+
+  elements = parse_lines_in_parallel<ImportedElement>
+             (cells_begin, p,
+              [] (const char *&q, const char *end)
+  {
+    ImportedElement element;
+    read_integer (q, end);
+    element.tag = read_integer (q, end);
+    const std::string type = read_word (q, end);
+    if (type == "quad")
+      element.n_vertices = 4;
+    else if (type == "line")
+      element.n_vertices = 2;
+    else
+      AssertThrow (false,
+                   ExcMessage ("UCD cell type <" + type
+                               + "> is not supported."));
+    for (unsigned int v=0; v<element.n_vertices; ++v)
+      element.vertices[v] = read_integer (q, end);
+    return element;
+  });
+
+  AssertThrow ((static_cast<long>(nodes.size()) == n_nodes)
+               && (static_cast<long>(elements.size()) == n_cells),
+               ExcMessage ("The UCD file has fewer nodes or cells than its "
+                           "header says."));
+}
+
+
+
+// @sect4{Creating the triangulation}
+
+// Once we have the nodes and elements, the rest is what GridIn does as
+// well: translate node numbers into indices, collect cells and boundary
+// faces in the data structures Triangulation::create_triangulation()
+// expects, make sure all cells are oriented consistently, and create the
+// triangulation. Both file formats list the vertices of a cell in
+// counter-clockwise order, which is what
+// create_triangulation_compatibility() expects. The tags become material
+// and boundary ids, which are small integer types in deal.II; the largest
+// value of each is reserved to mean "invalid" and "interior face", so
+// tags that do not fit below it are rejected instead of silently wrapping
+// around.
+void import_mesh (const std::string &filename,
+                  Triangulation<2>  &triangulation)
+{
+  TraceScope trace_scope ("import mesh");
+  const MappedFile file (filename);
+
+  std::vector<ImportedNode>    nodes;
+  std::vector<ImportedElement> elements;
+  if (compression_from_file_name (filename) != OutputCompression::none)
+    AssertThrow (false,
+                 ExcMessage ("Compressed input files are not supported."));
+
+  const std::string::size_type dot = filename.rfind ('.');
+  const std::string extension = (dot == std::string::npos ?
+                                 "" :
+                                 filename.substr (dot+1));
+  if (extension == "msh")
+    read_msh (file, nodes, elements);
+  else if ((extension == "inp") || (extension == "ucd"))
+    read_ucd (file, nodes, elements);
+  else
+    AssertThrow (false,
+                 ExcMessage ("Cannot determine the format of input file <"
+                             + filename + ">."));
+
+  // Node numbers usually run from one to the number of nodes, but both
+  // formats allow gaps. Translating them through a table indexed by node
+  // number is fastest, but the table must not become much larger than the
+  // number of nodes (a single node numbered 10^10 would otherwise need
+  // tens of GB); if it would, we sort the node numbers and search in them
+  // instead.
+  long max_node_id = 0;
+  std::vector<Point<2> > vertices (nodes.size());
+  for (unsigned int n=0; n<nodes.size(); ++n)
+    {
+      AssertThrow (nodes[n].id >= 0,
+                   ExcMessage ("Negative node numbers are not allowed."));
+      max_node_id = std::max (max_node_id, nodes[n].id);
+      vertices[n] = nodes[n].position;
+    }
+
+  const bool dense_numbering
+    = (max_node_id < 4 * static_cast<long>(nodes.size()) + 1024);
+  std::vector<unsigned int>                    node_index;
+  std::vector<std::pair<long,unsigned int> >   sorted_node_ids;
+  if (dense_numbering)
+    {
+      node_index.assign (max_node_id+1, numbers::invalid_unsigned_int);
+      for (unsigned int n=0; n<nodes.size(); ++n)
+        node_index[nodes[n].id] = n;
+    }
+  else
+    {
+      sorted_node_ids.reserve (nodes.size());
+      for (unsigned int n=0; n<nodes.size(); ++n)
+        sorted_node_ids.push_back (std::make_pair (nodes[n].id, n));
+      std::sort (sorted_node_ids.begin(), sorted_node_ids.end());
+    }
+
+  const auto vertex_index = [&] (const long id)
+  {
+    unsigned int index = numbers::invalid_unsigned_int;
+    if (dense_numbering)
+      {
+        if ((id >= 0) && (id <= max_node_id))
+          index = node_index[id];
+      }
+    else
+      {
+        const std::vector<std::pair<long,unsigned int> >::const_iterator
+        p = std::lower_bound (sorted_node_ids.begin(), sorted_node_ids.end(),
+                              std::make_pair (id, 0u));
+        if ((p != sorted_node_ids.end()) && (p->first == id))
+          index = p->second;
+      }
+    AssertThrow (index != numbers::invalid_unsigned_int,
+                 ExcMessage ("An element refers to node "
+                             + Utilities::int_to_string (id)
+                             + ", which does not exist."));
+    return index;
+  };
+
+  std::vector<CellData<2> > cells;
+  SubCellData               subcell_data;
+  for (unsigned int e=0; e<elements.size(); ++e)
+    if (elements[e].n_vertices == 4)
+      {
+        CellData<2> cell;
+        for (unsigned int v=0; v<4; ++v)
+          cell.vertices[v] = vertex_index (elements[e].vertices[v]);
+        AssertThrow ((elements[e].tag >= 0)
+                     && (elements[e].tag < numbers::invalid_material_id),
+                     ExcMessage ("The tag "
+                                 + Utilities::int_to_string (elements[e].tag)
+                                 + " of a cell is not a valid material id."));
+        cell.material_id = elements[e].tag;
+        cells.push_back (cell);
+      }
+    else if (elements[e].n_vertices == 2)
+      {
+        CellData<1> face;
+        for (unsigned int v=0; v<2; ++v)
+          face.vertices[v] = vertex_index (elements[e].vertices[v]);
+        AssertThrow ((elements[e].tag >= 0)
+                     && (elements[e].tag < numbers::internal_face_boundary_id),
+                     ExcMessage ("The tag "
+                                 + Utilities::int_to_string (elements[e].tag)
+                                 + " of a boundary face is not a valid "
+                                 "boundary id."));
+        face.boundary_id = elements[e].tag;
+        subcell_data.boundary_lines.push_back (face);
+      }
+
+  GridTools::delete_unused_vertices (vertices, cells, subcell_data);
+  GridReordering<2>::invert_all_cells_of_negative_grid (vertices, cells);
+  GridReordering<2>::reorder_cells (cells);
+  triangulation.create_triangulation_compatibility (vertices, cells,
+                                                    subcell_data);
+}
+
+
+
+// @sect3{Curved output}
+
+// GridOut::write_eps() draws every edge of the mesh as a straight line,
+// even though the new vertices on the ring have been placed on circles.
+// To see the curved geometry, one has to evaluate a higher order mapping,
+// such as MappingQGeneric, at a number of points along each edge and draw
+// the polygon through these points. Evaluating the mapping is expensive,
+// however, and if we write the same mesh several times (in different
+// formats, or with different levels of detail), we do not want to do it
+// each time.
+//
+// The following class therefore computes the points along all edges once
+// and keeps them until the triangulation changes, which it learns about
+// through the triangulation's <code>any_change</code> signal. Each edge is
+// stored once, even though it is shared by two cells, and edges that are
+// refined are represented by their children. The points of edge
+// <code>e</code> are <code>points[e*(n_subdivisions+1)]</code> through
+// <code>points[e*(n_subdivisions+1)+n_subdivisions]</code>.
+class CurvedEdgeCache
+{
+public:
+  CurvedEdgeCache (const Triangulation<2> &triangulation,
+                   const Mapping<2>       &mapping,
+                   const unsigned int      n_subdivisions);
+  ~CurvedEdgeCache ();
+
+  // Write the edges as polygons, using every <code>stride</code>-th of the
+  // cached points; a stride of one uses all of them, larger strides give
+  // coarser (and smaller) output. The stride must divide
+  // <code>n_subdivisions</code>.
+  void write_eps (std::ostream &out, const unsigned int stride = 1) const;
+  void write_svg (std::ostream &out, const unsigned int stride = 1) const;
+
+  // The number of times the points were computed, to verify that repeated
+  // writes reuse them:
+  unsigned int n_updates () const
+  {
+    return update_count;
+  }
+
+private:
+  void update () const;
+  void invalidate ();
+
+  const Triangulation<2>         &triangulation;
+  const Mapping<2>               &mapping;
+  const unsigned int              n_subdivisions;
+
+  mutable bool                    is_current;
+  mutable std::vector<Point<2> >  points;
+  mutable unsigned int            update_count;
+  mutable Point<2>                lower_left;
+  mutable Point<2>                upper_right;
+  boost::signals2::connection     connection;
+};
+
+
+
+CurvedEdgeCache::CurvedEdgeCache (const Triangulation<2> &triangulation,
+                                  const Mapping<2>       &mapping,
+                                  const unsigned int      n_subdivisions)
+  :
+  triangulation (triangulation),
+  mapping (mapping),
+  n_subdivisions (n_subdivisions),
+  is_current (false),
+  update_count (0)
+{
+  connection = triangulation.signals.any_change.connect
+               (std::bind (&CurvedEdgeCache::invalidate, this));
+}
+
+
+
+CurvedEdgeCache::~CurvedEdgeCache ()
+{
+  connection.disconnect ();
+}
+
+
+
+void CurvedEdgeCache::invalidate ()
+{
+  is_current = false;
+}
+
+
+
+// Computing the points: for each face of each active cell, unless we have
+// already done so from the other side or the face is refined (in which
+// case the children are faces of the neighboring cells), we map
+// equidistant points on the corresponding edge of the reference cell to
+// real space:
+void CurvedEdgeCache::update () const
+{
+  if (is_current)
+    return;
+
+  points.clear ();
+  std::vector<bool> edge_visited (triangulation.n_raw_lines(), false);
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    for (unsigned int f=0; f<GeometryInfo<2>::faces_per_cell; ++f)
+      {
+        if (cell->face(f)->has_children() || edge_visited[cell->face(f)->index()])
+          continue;
+        edge_visited[cell->face(f)->index()] = true;
+
+        const Point<2> start
+          = GeometryInfo<2>::unit_cell_vertex (GeometryInfo<2>::face_to_cell_vertices(f,0));
+        const Point<2> end
+          = GeometryInfo<2>::unit_cell_vertex (GeometryInfo<2>::face_to_cell_vertices(f,1));
+        for (unsigned int i=0; i<=n_subdivisions; ++i)
+          {
+            const double t = 1. * i / n_subdivisions;
+            points.push_back (mapping.transform_unit_to_real_cell
+                              (cell, start + t * (end - start)));
+          }
+      }
+
+  lower_left  = Point<2> (std::numeric_limits<double>::max(),
+                          std::numeric_limits<double>::max());
+  upper_right = Point<2> (-std::numeric_limits<double>::max(),
+                          -std::numeric_limits<double>::max());
+  for (unsigned int i=0; i<points.size(); ++i)
+    for (unsigned int d=0; d<2; ++d)
+      {
+        lower_left[d]  = std::min (lower_left[d], points[i][d]);
+        upper_right[d] = std::max (upper_right[d], points[i][d]);
+      }
+
+  is_current = true;
+  ++update_count;
+}
+
+
+
+// The two output functions. Both scale the mesh so that its larger
+// extent is 300 (for EPS, in points) or 1000 (for SVG, in pixels) units
+// wide, and draw each edge as one polygon.
+void CurvedEdgeCache::write_eps (std::ostream       &out,
+                                 const unsigned int  stride) const
+{
+  Assert (n_subdivisions % stride == 0, ExcMessage ("Invalid stride."));
+  update ();
+
+  const double scale = 300. / std::max (upper_right[0] - lower_left[0],
+                                        upper_right[1] - lower_left[1]);
+  out << "%!PS-Adobe-2.0 EPSF-1.2" << '\n'
+      << "%%Title: deal.II curved output (ring_refinement)" << '\n'
+      << "%%BoundingBox: 0 0 "
+      << static_cast<unsigned int>((upper_right[0] - lower_left[0]) * scale + 1) << ' '
+      << static_cast<unsigned int>((upper_right[1] - lower_left[1]) * scale + 1) << '\n'
+      << "%%EndComments" << '\n'
+      << "0.5 setlinewidth" << '\n';
+
+  const unsigned int points_per_edge = n_subdivisions+1;
+  for (unsigned int e=0; e<points.size()/points_per_edge; ++e)
+    {
+      for (unsigned int i=0; i<=n_subdivisions; i+=stride)
+        {
+          const Point<2> &p = points[e*points_per_edge + i];
+          out << (p[0] - lower_left[0]) * scale << ' '
+              << (p[1] - lower_left[1]) * scale
+              << (i == 0 ? " moveto " : " lineto ");
+        }
+      out << "stroke" << '\n';
+    }
+  out << "showpage" << '\n';
+  out.flush ();
+}
+
+
+
+void CurvedEdgeCache::write_svg (std::ostream       &out,
+                                 const unsigned int  stride) const
+{
+  Assert (n_subdivisions % stride == 0, ExcMessage ("Invalid stride."));
+  update ();
+
+  // SVG's y-axis points down, so we flip the mesh vertically:
+  const double scale = 1000. / std::max (upper_right[0] - lower_left[0],
+                                         upper_right[1] - lower_left[1]);
+  out << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\""
+      << (upper_right[0] - lower_left[0]) * scale << "\" height=\""
+      << (upper_right[1] - lower_left[1]) * scale << "\">" << '\n'
+      << "<g fill=\"none\" stroke=\"black\" stroke-width=\"0.5\">" << '\n';
+
+  const unsigned int points_per_edge = n_subdivisions+1;
+  for (unsigned int e=0; e<points.size()/points_per_edge; ++e)
+    {
+      out << "<polyline points=\"";
+      for (unsigned int i=0; i<=n_subdivisions; i+=stride)
+        {
+          const Point<2> &p = points[e*points_per_edge + i];
+          out << (p[0] - lower_left[0]) * scale << ','
+              << (upper_right[1] - p[1]) * scale << ' ';
+        }
+      out << "\"/>" << '\n';
+    }
+  out << "</g>" << '\n' << "</svg>" << '\n';
+  out.flush ();
+}
+
+
+
+// second_grid() calls the following function to write the curved mesh,
+// at full detail in both formats and at two coarser levels of detail in
+// SVG format. All four files are written from the same cached points; we
+// report how long it took to compute them (the first write) and how long
+// the subsequent writes took.
+void write_curved_grid (const Triangulation<2> &triangulation,
+                        const std::string      &base_name,
+                        const ProgramOptions   &options)
+{
+  TraceScope trace_scope ("write curved grid");
+  const MappingQGeneric<2> mapping (options.mapping_degree);
+  const unsigned int       n_subdivisions = 8;
+  const CurvedEdgeCache    cache (triangulation, mapping, n_subdivisions);
+
+  const unsigned int strides[] = { 1, 2, 4 };
+  Timer timer;
+  for (unsigned int i=0; i<sizeof(strides)/sizeof(strides[0]); ++i)
+    {
+      const std::string lod = (strides[i] == 1 ?
+                               "" :
+                               "-lod" + Utilities::int_to_string (i));
+      if (strides[i] == 1)
+        {
+          const std::string filename = base_name + "-curved.eps"
+                                       + options.output_suffix;
+          const std::unique_ptr<std::ostream> out = open_output_file (filename);
+          cache.write_eps (*out);
+          close_output_file (*out);
+        }
+      {
+        const std::string filename = base_name + "-curved" + lod + ".svg"
+                                     + options.output_suffix;
+        const std::unique_ptr<std::ostream> out = open_output_file (filename);
+        cache.write_svg (*out, strides[i]);
+        close_output_file (*out);
+      }
+
+      std::cout << "Curved grid written at level of detail " << i
+                << " in " << timer.wall_time() << " s" << std::endl;
+      timer.restart ();
+    }
+
+  AssertThrow (cache.n_updates() == 1, ExcInternalError());
+}
+
+
+
+// @sect3{Guarding against running out of memory}
+
+// Every refinement step multiplies the number of cells flagged for
+// refinement by four, and a mistyped argument to
+// Triangulation::refine_global() or one refinement step too many can make
+// a program request far more memory than the machine has. The operating
+// system then either kills the program or, worse, the whole machine
+// grinds to a halt. In this section, we estimate the memory a refinement
+// step will need before we execute it, and stop or refine less if that
+// would exceed a budget given on the command line.
+//
+// The estimate is based on the flags set on the cells. After calling
+// Triangulation::prepare_coarsening_and_refinement(), which adds the flags
+// that the triangulation needs for consistency (for example to avoid
+// cells with more than one hanging node on a face), the flags are exactly
+// what execute_coarsening_and_refinement() will act upon, and we can
+// count: each cell flagged for refinement gets four children, and every
+// four cells flagged for coarsening are replaced by their parent. In 2d,
+// refining a cell adds a vertex at its center and one at the midpoint of
+// each of its edges that is not yet refined; we count each edge only once.
+// Memory is extrapolated from the current memory use of the triangulation
+// per cell.
+struct RefinementForecast
+{
+  unsigned int n_cells_to_refine;
+  unsigned int n_cells_to_coarsen;
+  unsigned int n_active_cells_after;
+  unsigned int n_new_vertices;
+  double       current_memory;
+  double       predicted_memory;
+
+  void print (std::ostream &out) const;
+};
+
+
+
+void RefinementForecast::print (std::ostream &out) const
+{
+  out << "  Forecast: refining " << n_cells_to_refine
+      << " and coarsening " << n_cells_to_coarsen << " cells yields "
+      << n_active_cells_after << " active cells and up to "
+      << n_new_vertices << " new vertices; memory "
+      << current_memory / (1<<20) << " MB -> about "
+      << predicted_memory / (1<<20) << " MB" << std::endl;
+}
+
+
+
+// The prediction for the memory of the process adds to its current
+// resident set size twice the growth of the triangulation: while
+// refining, the triangulation enlarges its internal arrays, and
+// std::vector may temporarily hold both the old and the new array when it
+// does so.
+RefinementForecast forecast_refinement (Triangulation<2> &triangulation)
+{
+  triangulation.prepare_coarsening_and_refinement ();
+
+  RefinementForecast forecast;
+  forecast.n_cells_to_refine  = 0;
+  forecast.n_cells_to_coarsen = 0;
+  forecast.n_new_vertices     = 0;
+
+  std::vector<bool> edge_is_split (triangulation.n_raw_lines(), false);
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (cell->refine_flag_set())
+      {
+        ++forecast.n_cells_to_refine;
+        ++forecast.n_new_vertices;
+        for (unsigned int f=0; f<GeometryInfo<2>::faces_per_cell; ++f)
+          if (!cell->face(f)->has_children()
+              && !edge_is_split[cell->face(f)->index()])
+            {
+              edge_is_split[cell->face(f)->index()] = true;
+              ++forecast.n_new_vertices;
+            }
+      }
+    else if (cell->coarsen_flag_set())
+      ++forecast.n_cells_to_coarsen;
+
+  const unsigned int children_per_cell = GeometryInfo<2>::max_children_per_cell;
+  forecast.n_active_cells_after
+    = triangulation.n_active_cells()
+      + (children_per_cell-1) * forecast.n_cells_to_refine
+      - (children_per_cell-1) * (forecast.n_cells_to_coarsen / children_per_cell);
+
+  const double triangulation_memory = triangulation.memory_consumption();
+  const double memory_per_cell      = triangulation_memory / triangulation.n_cells();
+  const double new_cells            = children_per_cell * forecast.n_cells_to_refine;
+
+  Utilities::System::MemoryStats memory_stats;
+  Utilities::System::get_memory_stats (memory_stats);
+  forecast.current_memory   = 1024. * memory_stats.VmRSS;
+  forecast.predicted_memory = forecast.current_memory
+                              + 2 * memory_per_cell * new_cells;
+
+  return forecast;
+}
+
+
+
+// The exception we throw if a refinement step would exceed the budget and
+// the user asked for an error in that case:
+DeclException2 (ExcMemoryBudgetExceeded,
+                double, double,
+                << "The next refinement step would need about " << arg1
+                << " MB of memory, but the memory budget is only " << arg2
+                << " MB. Use --over-budget=stop or --over-budget=degrade to "
+                << "stop refining or to refine fewer cells instead.");
+
+
+
+// The guard itself is called between marking cells and executing the
+// refinement. It returns whether the refinement should go ahead. If the
+// forecast exceeds the budget, what happens depends on
+// <code>--over-budget</code>. With "error", we throw the exception above.
+// With "degrade", we remove refinement flags until the forecast fits: we
+// estimate which fraction of the flagged cells we can afford, keep that
+// many (in the order in which we encounter them) and repeat the forecast,
+// since prepare_coarsening_and_refinement() may have to add flags back.
+// With "stop" (the default), or if no cell can be refined within the
+// budget, we clear all flags and tell the caller to stop refining.
+//
+// The budget is given in MB; we convert it to bytes in floating point
+// arithmetic, since budgets of 4096 MB and more do not fit into an
+// <code>unsigned int</code> when counted in bytes.
+//
+// The forecast walks over all cells and their faces, which is not free on
+// large meshes, so without a budget and without <code>--forecast</code>
+// there is nothing to compute:
+bool check_refinement_memory (Triangulation<2>     &triangulation,
+                              const ProgramOptions &options)
+{
+  if ((options.memory_budget == 0) && !options.report_memory_forecast)
+    return true;
+
+  RefinementForecast forecast = forecast_refinement (triangulation);
+  if (options.report_memory_forecast)
+    forecast.print (std::cout);
+
+  const double budget = options.memory_budget * 1048576.;
+  if ((options.memory_budget == 0) || (forecast.predicted_memory <= budget))
+    return true;
+
+  AssertThrow (options.over_budget_action != OverBudgetAction::error,
+               ExcMemoryBudgetExceeded (forecast.predicted_memory / 1048576.,
+                                        options.memory_budget));
+
+  const unsigned int n_cells_originally_flagged = forecast.n_cells_to_refine;
+  for (unsigned int attempt=0;
+       (options.over_budget_action == OverBudgetAction::degrade)
+       && (attempt < 10) && (forecast.n_cells_to_refine > 0)
+       && (forecast.predicted_memory > budget);
+       ++attempt)
+    {
+      const double affordable_fraction
+        = std::max (budget - forecast.current_memory, 0.)
+          / (forecast.predicted_memory - forecast.current_memory);
+      const unsigned int n_cells_to_keep
+        = std::min (static_cast<unsigned int>(affordable_fraction
+                                              * forecast.n_cells_to_refine),
+                    forecast.n_cells_to_refine - 1);
+
+      unsigned int n_kept = 0;
+      for (Triangulation<2>::active_cell_iterator
+           cell = triangulation.begin_active();
+           cell != triangulation.end(); ++cell)
+        if (cell->refine_flag_set() && (++n_kept > n_cells_to_keep))
+          cell->clear_refine_flag ();
+
+      forecast = forecast_refinement (triangulation);
+    }
+
+  if ((forecast.n_cells_to_refine == 0) || (forecast.predicted_memory > budget))
+    {
+      for (Triangulation<2>::active_cell_iterator
+           cell = triangulation.begin_active();
+           cell != triangulation.end(); ++cell)
+        {
+          cell->clear_refine_flag ();
+          cell->clear_coarsen_flag ();
+        }
+
+      std::cout << "  Memory budget of " << options.memory_budget
+                << " MB reached; stopping refinement." << std::endl;
+      return false;
+    }
+
+  std::cout << "  Memory budget of " << options.memory_budget
+            << " MB: refining only " << forecast.n_cells_to_refine
+            << " of " << n_cells_originally_flagged << " flagged cells."
+            << std::endl;
+  return true;
+}
+
+
+
+// Global refinement is nothing but flagging all cells and refining them,
+// one level at a time, so we can put the same guard in front of every
+// level:
+void refine_global_within_budget (Triangulation<2>     &triangulation,
+                                  const unsigned int    times,
+                                  const ProgramOptions &options)
+{
+  for (unsigned int i=0; i<times; ++i)
+    {
+      triangulation.set_all_refine_flags ();
+      if (!check_refinement_memory (triangulation, options))
+        break;
+      triangulation.execute_coarsening_and_refinement ();
+    }
+}
+
+
+
+// @sect3{Creating the coarse ring}
+
+// GridGenerator::hyper_shell() creates the ring of second_grid() with ten
+// cells, and several parts of the program below create the same ring,
+// sometimes with many more cells around the circumference. They all do so
+// through the following function, so that the time it takes shows up in
+// the timeline of the program (see the TraceRecorder class). The
+// coarse-ring benchmark below shows how this time grows with the number of
+// cells.
+void create_ring (Triangulation<2>   &triangulation,
+                  const Point<2>     &center,
+                  const double        inner_radius,
+                  const double        outer_radius,
+                  const unsigned int  n_cells)
+{
+  TraceScope trace_scope ("create coarse ring");
+  GridGenerator::hyper_shell (triangulation,
+                              center, inner_radius, outer_radius,
+                              n_cells);
+}
+
+
+
+// @sect3{Creating the first mesh}
+
+// In the following, first function, we simply use the unit square as domain
+// and produce a globally refined grid from it.
+void first_grid (const ProgramOptions &options)
+{
+  TraceScope trace_scope ("first grid");
+
+  // The first thing to do is to define an object for a triangulation of a
+  // two-dimensional domain:
+  Triangulation<2> triangulation;
+  // Here and in many following cases, the string "<2>" after a class name
+  // indicates that this is an object that shall work in two space
+  // dimensions. Likewise, there are versions of the triangulation class that
+  // are working in one ("<1>") and three ("<3>") space dimensions. The way
+  // this works is through some template magic that we will investigate in
+  // some more detail in later example programs; there, we will also see how
+  // to write programs in an essentially dimension independent way.
+
+  // Next, we want to fill the triangulation with a single cell for a square
+  // domain. The triangulation is the refined four times, to yield $4^4=256$
+  // cells in total. Instead of calling Triangulation::refine_global()
+  // directly, we use the function above that checks before each level that
+  // we stay within the memory budget, if one was given:
+  GridGenerator::hyper_cube (triangulation);
+  refine_global_within_budget (triangulation, 4, options);
+
+  // Now we want to write a graphical representation of the mesh to an output
+  // file. The write_grid() function above does this in the formats given on
+  // the command line, by default in encapsulated postscript (eps) format,
+  // and compresses the file if the user asked for it:
+  write_grid (triangulation, "grid-1", options);
+}
+
+
+
+// @sect3{Marking cells for refinement}
+
+// The second grid below is refined several times towards the inner circle
+// of a ring. There are different ways of deciding which cells to refine in
+// each of these steps, and we put each of them into a function of its own.
+//
+// The first one is the one we started out with: it simply loops over all
+// active cells and flags every cell that has a vertex on the inner circle.
+void mark_inner_boundary_cells (Triangulation<2> &triangulation,
+                                const Point<2>   &center,
+                                const double      inner_radius)
+{
+  // We need an iterator that points to a cell and which we will
+  // move over all active cells one by one. In a sense, you can think of a
+  // triangulation as a collection of cells. If it was an array, you would
+  // just get a pointer that you move from one to the next. In
+  // triangulations, cells aren't stored as an array, so simple pointers
+  // do not work, but one can generalize pointers to iterators (see <a
+  // href="http://en.wikipedia.org/wiki/Iterator#C.2B.2B">this wikipedia
+  // link</a> for more information). We will then get an iterator to the
+  // first cell and iterate over all of the cells until we hit the last
+  // one.
+  //
+  // The second important piece is that we only need the active cells.
+  // Active cells are those that are not further refined, and the only
+  // ones that can be marked for further refinement, obviously. deal.II
+  // provides iterator categories that allow us to iterate over <i>all</i>
+  // cells (including the parent cells of active ones) or only over the
+  // active cells. Because we want the latter, we need to choose
+  // Triangulation::active_cell_iterator as data type.
+  //
+  // Finally, by convention, we almost always use the names
+  // <code>cell</code> and <code>endc</code> for the iterator pointing to
+  // the present cell and to the "one-past-the-end" iterator. This is, in
+  // a sense a misnomer, because the object is not really a "cell": it is
+  // an iterator/pointer to a cell. We should really have started to call
+  // these objects <code>cell_iterator</code> when deal.II started in
+  // 1998, but it is what it is.
+  //
+  // After declaring the iterator variable, the loop over all cells is
+  // then rather trivial, and looks like any loop involving pointers
+  // instead of iterators:
+  Triangulation<2>::active_cell_iterator
+  cell = triangulation.begin_active(),
+  endc = triangulation.end();
+  for (; cell!=endc; ++cell)
+    {
+      // @note Writing a loop like this requires a lot of typing, but it
+      // is the only way of doing it in C++98 and C++03. However, if you
+      // have a C++11-compliant compiler, you can also use the C++11
+      // range-based for loop style that requires significantly less
+      // typing. Take a look at @ref CPP11 "the deal.II C++11 page" to see
+      // how this works.
+      //
+      // Next, we want to loop over all vertices of the cells. Since we are
+      // in 2d, we know that each cell has exactly four vertices. However,
+      // instead of penning down a 4 in the loop bound, we make a first
+      // attempt at writing it in a dimension-independent way by which we
+      // find out about the number of vertices of a cell. Using the
+      // GeometryInfo class, we will later have an easier time getting the
+      // program to also run in 3d: we only have to change all occurrences
+      // of <code>&lt;2&gt;</code> to <code>&lt;3&gt;</code>, and do not
+      // have to audit our code for the hidden appearance of magic numbers
+      // like a 4 that needs to be replaced by an 8:
+      for (unsigned int v=0;
+           v < GeometryInfo<2>::vertices_per_cell;
+           ++v)
+        {
+          // If this cell is at the inner boundary, then at least one of its
+          // vertices must sit on the inner ring and therefore have a radial
+          // distance from the center of exactly 0.5, up to floating point
+          // accuracy. Compute this distance, and if we have found a vertex
+          // with this property flag this cell for later refinement. We can
+          // then also break the loop over all vertices and move on to the
+          // next cell.
+          const double distance_from_center
+            = center.distance (cell->vertex(v));
+
+          if (std::fabs(distance_from_center - inner_radius) < 1e-10)
+            {
+              cell->set_refine_flag ();
+              break;
+            }
+        }
+    }
+}
+
+
+
+// @sect4{Marking by a refinement indicator}
+
+// The function above flags every cell that touches the inner circle, no
+// matter how many there are. Since the number of such cells grows with every
+// refinement step, so does the memory needed for the next step, and there is
+// no way to put a bound on it.
+//
+// The way finite element programs usually handle this is to first compute
+// a "refinement indicator" for every cell, i.e., a number that says how
+// much we would like to refine it, and to then let one of the functions in
+// the GridRefinement namespace choose which cells to actually flag. Here,
+// the indicator is derived from the distance of a cell to the inner circle,
+// which we define as the smallest distance of any of its vertices to the
+// circle. The GridRefinement functions flag the cells with the
+// <i>largest</i> indicators and require the indicators to be non-negative,
+// so we use $\frac{h_K}{h_K+d_K}$ where $h_K$ is the diameter of the cell
+// and $d_K$ its distance to the circle. This is one for cells that touch the
+// circle and becomes small for cells far away from it, relative to their
+// size.
+//
+// The indicators are stored in a Vector<float> indexed by
+// <code>cell-@>active_cell_index()</code>, and are all computed in a single
+// pass over the active cells:
+void compute_ring_distance_indicator (const Triangulation<2> &triangulation,
+                                      const Point<2>         &center,
+                                      const double            inner_radius,
+                                      Vector<float>          &indicator)
+{
+  indicator.reinit (triangulation.n_active_cells());
+
+  Triangulation<2>::active_cell_iterator
+  cell = triangulation.begin_active(),
+  endc = triangulation.end();
+  for (; cell!=endc; ++cell)
+    {
+      double distance_to_circle = std::numeric_limits<double>::max();
+      for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+        distance_to_circle
+          = std::min (distance_to_circle,
+                      std::fabs (center.distance (cell->vertex(v))
+                                 - inner_radius));
+
+      const double diameter = cell->diameter();
+      indicator(cell->active_cell_index())
+        = diameter / (diameter + distance_to_circle);
+    }
+}
+
+
+
+// Given the indicators, flagging is a single call. The "fixed number"
+// strategy refines the given fraction of all cells (the ones with the
+// largest indicators), and optionally never lets the mesh grow beyond a
+// given number of cells. The "fixed fraction" strategy instead refines the
+// cells whose indicators together make up the given fraction of the sum of
+// all indicators. In both cases, one could also ask for a fraction of cells
+// to be coarsened; since this loop only refines, that fraction is zero by
+// default.
+void mark_cells_by_indicator (Triangulation<2>     &triangulation,
+                              const Point<2>       &center,
+                              const double          inner_radius,
+                              const ProgramOptions &options)
+{
+  Vector<float> indicator;
+  compute_ring_distance_indicator (triangulation, center, inner_radius,
+                                   indicator);
+
+  switch (options.refinement_strategy)
+    {
+    case RefinementStrategy::fixed_number:
+      GridRefinement::refine_and_coarsen_fixed_number (triangulation,
+                                                       indicator,
+                                                       options.refine_fraction,
+                                                       options.coarsen_fraction,
+                                                       options.max_n_cells);
+      break;
+
+    case RefinementStrategy::fixed_fraction:
+      GridRefinement::refine_and_coarsen_fixed_fraction (triangulation,
+                                                         indicator,
+                                                         options.refine_fraction,
+                                                         options.coarsen_fraction);
+      break;
+
+    default:
+      Assert (false, ExcInternalError());
+    }
+}
+
+
+
+// @sect4{Vertex-centric marking}
+
+// The loop in mark_inner_boundary_cells() computes the distance of a vertex
+// from the center once for every cell the vertex belongs to, i.e., up to
+// four times for interior vertices in 2d. Instead, we can loop over the
+// vertices of the triangulation once, decide for each one whether it lies
+// on the circle, and then flag all cells adjacent to the vertices that do.
+//
+// For the last part, we need to know which cells are adjacent to a vertex.
+// GridTools::vertex_to_cell_map() computes this, but it returns a vector of
+// std::set objects, which is expensive to build and to walk through, and
+// it has to be called again after every refinement. The following class
+// stores the cells adjacent to each vertex in a plain array, and keeps it
+// current as the mesh changes: refinement and coarsening only change the
+// cells around the vertices of the cells that were refined or whose
+// children were removed, so rather than building the whole map again, we
+// only update the entries of these vertices.
+//
+// The triangulation tells us about these cells through its signals:
+// <code>post_refinement_on_cell</code> for each cell that has just been
+// refined, and <code>pre_coarsening_on_cell</code> for each cell whose
+// children are about to be removed. While the triangulation is in the
+// middle of changing, the parents of coarsened cells are not active yet,
+// and deal.II may reuse the storage of removed cells for new ones, so we
+// only record these cells, and update the map once the
+// <code>post_refinement</code> signal says that the mesh is complete
+// again: first we remove the coarsened children, then replace refined
+// cells by their children, and finally add the now active parents of the
+// coarsened cells. Creating a new mesh in the triangulation still builds
+// the map from scratch.
+class VertexToCellMap
+{
+public:
+  typedef std::vector<Triangulation<2>::active_cell_iterator>::const_iterator
+  const_iterator;
+
+  VertexToCellMap (const Triangulation<2> &triangulation);
+  ~VertexToCellMap ();
+
+  const_iterator begin (const unsigned int vertex) const
+  {
+    return cells_of_vertex[vertex].begin();
+  }
+
+  const_iterator end (const unsigned int vertex) const
+  {
+    return cells_of_vertex[vertex].end();
+  }
+
+  // The wall time the last update after refinement (or the last rebuild)
+  // took, so that benchmarks can account for it:
+  double last_update_time () const
+  {
+    return update_time;
+  }
+
+private:
+  void rebuild ();
+  void clear ();
+  void record_refined_cell (const Triangulation<2>::cell_iterator &cell);
+  void record_coarsened_cell (const Triangulation<2>::cell_iterator &cell);
+  void update ();
+
+  void add (const unsigned int                            vertex,
+            const Triangulation<2>::active_cell_iterator &cell);
+  void remove (const unsigned int                     vertex,
+               const Triangulation<2>::cell_iterator &cell);
+
+  const Triangulation<2>                                            &triangulation;
+  std::vector<std::vector<Triangulation<2>::active_cell_iterator> >  cells_of_vertex;
+
+  std::vector<Triangulation<2>::cell_iterator>                       refined_cells;
+  std::vector<Triangulation<2>::cell_iterator>                       coarsened_cells;
+  std::vector<std::pair<unsigned int,Triangulation<2>::cell_iterator> > removed_children;
+
+  std::vector<boost::signals2::connection>                           connections;
+  double                                                             update_time;
+};
+
+
+
+VertexToCellMap::VertexToCellMap (const Triangulation<2> &triangulation)
+  :
+  triangulation (triangulation),
+  update_time (0)
+{
+  rebuild ();
+  connections.push_back
+  (triangulation.signals.post_refinement_on_cell.connect
+   (std::bind (&VertexToCellMap::record_refined_cell, this,
+               std::placeholders::_1)));
+  connections.push_back
+  (triangulation.signals.pre_coarsening_on_cell.connect
+   (std::bind (&VertexToCellMap::record_coarsened_cell, this,
+               std::placeholders::_1)));
+  connections.push_back
+  (triangulation.signals.post_refinement.connect
+   (std::bind (&VertexToCellMap::update, this)));
+  connections.push_back
+  (triangulation.signals.create.connect
+   (std::bind (&VertexToCellMap::rebuild, this)));
+  connections.push_back
+  (triangulation.signals.clear.connect
+   (std::bind (&VertexToCellMap::clear, this)));
+}
+
+
+
+VertexToCellMap::~VertexToCellMap ()
+{
+  for (unsigned int i=0; i<connections.size(); ++i)
+    connections[i].disconnect ();
+}
+
+
+
+void VertexToCellMap::rebuild ()
+{
+  Timer timer;
+
+  clear ();
+  cells_of_vertex.resize (triangulation.n_vertices());
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      add (cell->vertex_index(v), cell);
+
+  update_time = timer.wall_time();
+}
+
+
+
+void VertexToCellMap::clear ()
+{
+  cells_of_vertex.clear ();
+  refined_cells.clear ();
+  coarsened_cells.clear ();
+  removed_children.clear ();
+}
+
+
+
+void VertexToCellMap::
+record_refined_cell (const Triangulation<2>::cell_iterator &cell)
+{
+  refined_cells.push_back (cell);
+}
+
+
+
+void VertexToCellMap::
+record_coarsened_cell (const Triangulation<2>::cell_iterator &cell)
+{
+  coarsened_cells.push_back (cell);
+  for (unsigned int c=0; c<cell->n_children(); ++c)
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      removed_children.push_back (std::make_pair (cell->child(c)->vertex_index(v),
+                                                  cell->child(c)));
+}
+
+
+
+void VertexToCellMap::update ()
+{
+  Timer timer;
+
+  for (unsigned int i=0; i<removed_children.size(); ++i)
+    remove (removed_children[i].first, removed_children[i].second);
+
+  cells_of_vertex.resize (triangulation.n_vertices());
+  for (unsigned int i=0; i<refined_cells.size(); ++i)
+    {
+      const Triangulation<2>::cell_iterator &parent = refined_cells[i];
+      for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+        remove (parent->vertex_index(v), parent);
+      for (unsigned int c=0; c<parent->n_children(); ++c)
+        for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+          add (parent->child(c)->vertex_index(v), parent->child(c));
+    }
+
+  for (unsigned int i=0; i<coarsened_cells.size(); ++i)
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      add (coarsened_cells[i]->vertex_index(v), coarsened_cells[i]);
+
+  refined_cells.clear ();
+  coarsened_cells.clear ();
+  removed_children.clear ();
+
+  update_time = timer.wall_time();
+}
+
+
+
+void VertexToCellMap::add (const unsigned int                            vertex,
+                           const Triangulation<2>::active_cell_iterator &cell)
+{
+  cells_of_vertex[vertex].push_back (cell);
+}
+
+
+
+// The order of the cells adjacent to a vertex does not matter, so removing
+// one can move the last one into its place:
+void VertexToCellMap::remove (const unsigned int                     vertex,
+                              const Triangulation<2>::cell_iterator &cell)
+{
+  std::vector<Triangulation<2>::active_cell_iterator> &cells
+    = cells_of_vertex[vertex];
+  for (unsigned int i=0; i<cells.size(); ++i)
+    if (cells[i] == cell)
+      {
+        cells[i] = cells.back();
+        cells.pop_back ();
+        return;
+      }
+}
+
+
+
+// With this, marking is a loop over all vertices in use. The function
+// returns how many distances it had to compute so that we can compare with
+// the cell-based loop.
+unsigned int
+mark_cells_at_circle_vertices (Triangulation<2>      &triangulation,
+                               const VertexToCellMap &vertex_to_cell_map,
+                               const Point<2>        &center,
+                               const double           radius)
+{
+  const std::vector<Point<2> > &vertices      = triangulation.get_vertices();
+  const std::vector<bool>      &used_vertices = triangulation.get_used_vertices();
+
+  unsigned int n_distance_evaluations = 0;
+  for (unsigned int v=0; v<vertices.size(); ++v)
+    if (used_vertices[v])
+      {
+        ++n_distance_evaluations;
+        if (std::fabs (center.distance (vertices[v]) - radius) < 1e-10)
+          for (VertexToCellMap::const_iterator
+               cell = vertex_to_cell_map.begin(v);
+               cell != vertex_to_cell_map.end(v); ++cell)
+            if (!(*cell)->refine_flag_set())
+              (*cell)->set_refine_flag ();
+      }
+
+  return n_distance_evaluations;
+}
+
+
+
+// @sect4{Hierarchical marking}
+
+// The loop in mark_inner_boundary_cells() looks at every active cell,
+// although after a few refinement steps almost all of them are far away
+// from the inner circle. The triangulation is not just a list of active
+// cells, however, but a forest of refinement trees, one per coarse cell:
+// every cell that has been refined knows its children. If we can tell
+// from a cell that none of its descendants can touch the circle, we can
+// skip the whole subtree at once.
+//
+// What we need for this is a range of distances from the center that
+// contains all vertices any descendant of a cell can have. If a new vertex
+// is placed by the SphericalManifold used in second_grid(), its distance
+// from the center is a weighted average of those of the vertices it is
+// computed from, so it lies between the smallest and largest distance of
+// the parent's vertices. If it is placed on straight lines, as in imported
+// meshes without a manifold, it lies in the convex hull of the parent's
+// vertices, whose distance from the center is bounded below by the
+// distance of the hull and above by the largest vertex distance. Taking
+// the smaller of the two lower bounds gives a range that is valid in
+// either case. If the circle's radius is outside of this range (with the
+// same tolerance as in the test for vertices), the subtree can be
+// skipped. The vertices of the quadrilateral, in the order in which we go
+// around it, are 0, 1, 3, 2:
+double distance_to_cell_hull (const Triangulation<2>::cell_iterator &cell,
+                              const Point<2>                        &p)
+{
+  const unsigned int around_the_cell[4] = { 0, 1, 3, 2 };
+
+  double distance = std::numeric_limits<double>::max();
+  bool   is_inside = true;
+  for (unsigned int e=0; e<4; ++e)
+    {
+      const Point<2> a = cell->vertex (around_the_cell[e]);
+      const Point<2> b = cell->vertex (around_the_cell[(e+1)%4]);
+      const Tensor<1,2> edge    = b - a;
+      const Tensor<1,2> to_p    = p - a;
+      const double      t       = std::max (0., std::min (1., (to_p * edge)
+                                                            / (edge * edge)));
+      distance = std::min (distance, p.distance (a + t * edge));
+
+      if (edge[0] * to_p[1] - edge[1] * to_p[0] < 0)
+        is_inside = false;
+    }
+  return (is_inside ? 0. : distance);
+}
+
+
+
+bool cell_may_touch_circle (const Triangulation<2>::cell_iterator &cell,
+                            const Point<2>                        &center,
+                            const double                           radius)
+{
+  double min_distance = std::numeric_limits<double>::max(),
+         max_distance = 0;
+  for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+    {
+      const double distance = center.distance (cell->vertex(v));
+      min_distance = std::min (min_distance, distance);
+      max_distance = std::max (max_distance, distance);
+    }
+  if (radius > max_distance + 1e-10)
+    return false;
+  if (radius >= min_distance - 1e-10)
+    return true;
+  return (radius >= distance_to_cell_hull (cell, center) - 1e-10);
+}
+
+
+
+// The traversal itself starts at a cell and collects those active cells
+// below it that have a vertex on the circle, using the same test as
+// mark_inner_boundary_cells(). It returns the number of cells it looked
+// at, for the benchmark below.
+//
+// The subtrees of different children are independent, so we can traverse
+// them in parallel. Near the root of the trees, we therefore create one
+// task per child, and the task scheduler's work stealing makes sure that
+// idle threads pick up subtrees from busy ones; since subtrees that are
+// skipped cost nothing, how much work a task does is impossible to
+// predict, and this is exactly the case work stealing is made for. Deeper
+// down, subtrees are small and a task would cost more than it saves, so we
+// recurse on the current thread. Each task collects cells into its own
+// vector, which the parent appends to its own once the tasks are done.
+const int hierarchical_task_levels = 4;
+
+unsigned long
+collect_cells_on_circle (const Triangulation<2>::cell_iterator               &cell,
+                         const Point<2>                                      &center,
+                         const double                                         radius,
+                         std::vector<Triangulation<2>::active_cell_iterator> &cells)
+{
+  if (!cell_may_touch_circle (cell, center, radius))
+    return 1;
+
+  if (cell->active())
+    {
+      for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+        if (std::fabs (center.distance (cell->vertex(v)) - radius) < 1e-10)
+          {
+            cells.push_back (cell);
+            break;
+          }
+      return 1;
+    }
+
+  unsigned long n_visited = 1;
+  if (cell->level() < hierarchical_task_levels)
+    {
+      std::vector<std::vector<Triangulation<2>::active_cell_iterator> >
+      child_cells (cell->n_children());
+      std::vector<unsigned long> child_n_visited (cell->n_children(), 0);
+
+      Threads::TaskGroup<void> tasks;
+      for (unsigned int c=0; c<cell->n_children(); ++c)
+        tasks += Threads::new_task (std::function<void ()> ([&, c] ()
+        {
+          child_n_visited[c] = collect_cells_on_circle (cell->child(c),
+                                                        center, radius,
+                                                        child_cells[c]);
+        }));
+      tasks.join_all ();
+
+      for (unsigned int c=0; c<cell->n_children(); ++c)
+        {
+          n_visited += child_n_visited[c];
+          cells.insert (cells.end(),
+                        child_cells[c].begin(), child_cells[c].end());
+        }
+    }
+  else
+    for (unsigned int c=0; c<cell->n_children(); ++c)
+      n_visited += collect_cells_on_circle (cell->child(c),
+                                            center, radius, cells);
+
+  return n_visited;
+}
+
+
+
+// The marking function starts one traversal per coarse cell. Setting the
+// refine flags is left until all traversals are done, and done on this
+// thread alone: the triangulation stores the flags of all cells of a level
+// in a std::vector<bool>, which packs them into bits, and two threads
+// setting the flags of neighboring cells would write to the same word of
+// memory. The flags that are set are exactly those set by
+// mark_inner_boundary_cells().
+unsigned long
+mark_inner_boundary_cells_hierarchically (Triangulation<2> &triangulation,
+                                          const Point<2>   &center,
+                                          const double      inner_radius)
+{
+  std::vector<Triangulation<2>::cell_iterator> coarse_cells;
+  for (Triangulation<2>::cell_iterator cell = triangulation.begin(0);
+       cell != triangulation.end(0); ++cell)
+    coarse_cells.push_back (cell);
+
+  std::vector<std::vector<Triangulation<2>::active_cell_iterator> >
+  cells_on_circle (coarse_cells.size());
+  std::vector<unsigned long> n_visited (coarse_cells.size(), 0);
+
+  Threads::TaskGroup<void> tasks;
+  for (unsigned int c=0; c<coarse_cells.size(); ++c)
+    tasks += Threads::new_task (std::function<void ()> ([&, c] ()
+    {
+      n_visited[c] = collect_cells_on_circle (coarse_cells[c],
+                                              center, inner_radius,
+                                              cells_on_circle[c]);
+    }));
+  tasks.join_all ();
+
+  for (unsigned int c=0; c<coarse_cells.size(); ++c)
+    for (unsigned int i=0; i<cells_on_circle[c].size(); ++i)
+      cells_on_circle[c][i]->set_refine_flag ();
+
+  return std::accumulate (n_visited.begin(), n_visited.end(), 0ul);
+}
+
+
+
+// @sect4{Caching the classification of vertices}
+
+// Refinement adds vertices but leaves the existing ones where they are,
+// with the same index. Whether a vertex lies on the inner circle is
+// therefore known from the previous step for all but the new vertices,
+// and mark_inner_boundary_cells() computes it again for all of them,
+// several times. The following class remembers the answer for each
+// vertex index. The array grows when refinement has created vertices with
+// larger indices than it has seen so far, and entries that have not been
+// computed yet are marked as unknown and computed when they are first
+// asked for.
+//
+// Three things can make an entry wrong. Coarsening removes vertices, and a
+// later refinement may reuse their indices for vertices at different
+// places; the triangulation tells us through its
+// <code>pre_coarsening_on_cell</code> signal about each cell whose children
+// are about to be removed, and we forget the children's vertices. Moving
+// vertices (with GridTools::transform(), say) or creating a different mesh
+// in the same triangulation changes everything, and we forget all entries.
+// Finally, the answer depends on the circle, which has to be given by
+// calling set_circle() before asking about vertices; if it differs from
+// the one used before, we also start over.
+class VertexClassificationCache
+{
+public:
+  VertexClassificationCache (const Triangulation<2> &triangulation);
+  ~VertexClassificationCache ();
+
+  void set_circle (const Point<2> &center,
+                   const double    radius);
+  bool is_on_circle (const unsigned int vertex);
+
+  // How often is_on_circle() could answer from the cache and how often it
+  // had to compute the answer since the last call to reset_statistics():
+  unsigned long n_hits () const
+  {
+    return hits;
+  }
+  unsigned long n_misses () const
+  {
+    return misses;
+  }
+  void reset_statistics ();
+
+private:
+  void forget_all ();
+  void forget_children_vertices (const Triangulation<2>::cell_iterator &cell);
+
+  enum Classification : unsigned char { unknown, off_circle, on_circle };
+
+  const Triangulation<2>                    &triangulation;
+  std::vector<unsigned char>                 classification;
+  Point<2>                                   cached_center;
+  double                                     cached_radius;
+  unsigned long                              hits;
+  unsigned long                              misses;
+  std::vector<boost::signals2::connection>   connections;
+};
+
+
+
+VertexClassificationCache::
+VertexClassificationCache (const Triangulation<2> &triangulation)
+  :
+  triangulation (triangulation),
+  cached_radius (-1),
+  hits (0),
+  misses (0)
+{
+  connections.push_back
+  (triangulation.signals.pre_coarsening_on_cell.connect
+   (std::bind (&VertexClassificationCache::forget_children_vertices, this,
+               std::placeholders::_1)));
+  connections.push_back
+  (triangulation.signals.transform.connect
+   (std::bind (&VertexClassificationCache::forget_all, this)));
+  connections.push_back
+  (triangulation.signals.create.connect
+   (std::bind (&VertexClassificationCache::forget_all, this)));
+  connections.push_back
+  (triangulation.signals.clear.connect
+   (std::bind (&VertexClassificationCache::forget_all, this)));
+}
+
+
+
+VertexClassificationCache::~VertexClassificationCache ()
+{
+  for (unsigned int i=0; i<connections.size(); ++i)
+    connections[i].disconnect ();
+}
+
+
+
+void VertexClassificationCache::set_circle (const Point<2> &center,
+                                            const double    radius)
+{
+  if ((radius != cached_radius) || (center.distance (cached_center) != 0))
+    {
+      forget_all ();
+      cached_center = center;
+      cached_radius = radius;
+    }
+}
+
+
+
+bool VertexClassificationCache::is_on_circle (const unsigned int vertex)
+{
+  if (vertex >= classification.size())
+    classification.resize (triangulation.n_vertices(), unknown);
+
+  if (classification[vertex] != unknown)
+    {
+      ++hits;
+      return (classification[vertex] == on_circle);
+    }
+
+  ++misses;
+  const bool on
+    = (std::fabs (cached_center.distance (triangulation.get_vertices()[vertex])
+                  - cached_radius) < 1e-10);
+  classification[vertex] = (on ? on_circle : off_circle);
+  return on;
+}
+
+
+
+void VertexClassificationCache::reset_statistics ()
+{
+  hits   = 0;
+  misses = 0;
+}
+
+
+
+void VertexClassificationCache::forget_all ()
+{
+  classification.clear ();
+}
+
+
+
+void VertexClassificationCache::
+forget_children_vertices (const Triangulation<2>::cell_iterator &cell)
+{
+  for (unsigned int c=0; c<cell->n_children(); ++c)
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      if (cell->child(c)->vertex_index(v) < classification.size())
+        classification[cell->child(c)->vertex_index(v)] = unknown;
+}
+
+
+
+// Marking with the cache is the same loop as in
+// mark_inner_boundary_cells(), with the distance test replaced by a
+// question to the cache:
+void mark_inner_boundary_cells_cached (Triangulation<2>          &triangulation,
+                                       VertexClassificationCache &cache,
+                                       const Point<2>            &center,
+                                       const double               inner_radius)
+{
+  cache.set_circle (center, inner_radius);
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      if (cache.is_on_circle (cell->vertex_index(v)))
+        {
+          cell->set_refine_flag ();
+          break;
+        }
+}
+
+
+
+// @sect4{Refinement criteria as plug-ins}
+
+// All of the functions above have the question of which cells to refine
+// written into their loops, and marking by any other rule means writing
+// another loop. The functions in this section separate the two: a
+// <i>criterion</i> is an object that looks at the geometry of a cell and
+// answers the question, and the marking functions below apply any
+// criterion to the cells of a triangulation.
+//
+// To make this cheap, criteria are template arguments of the marking
+// functions rather than objects called through a virtual function or a
+// std::function: the compiler sees the code of the criterion where it is
+// used and can inline it into the loop. For the same reason, criteria can
+// be combined with <code>&&</code> and <code>||</code> into new criteria
+// whose type records the whole expression, so that combinations are
+// inlined as well.
+//
+// A criterion does not answer with <code>true</code> or <code>false</code>
+// but with a number that is positive if the cell is to be refined. Then
+// "and" is the minimum and "or" the maximum of two answers, and a
+// criterion can be written once for both <code>double</code> and
+// VectorizedArray<double>: with the latter, it answers the question for
+// several cells at once, which is what the fast marking function below
+// uses. What a criterion gets to see about a cell is the following:
+template <typename Number>
+struct CellGeometry
+{
+  Number x[GeometryInfo<2>::vertices_per_cell];
+  Number y[GeometryInfo<2>::vertices_per_cell];
+  Number level;
+};
+
+
+
+// All criteria are derived from the following class template, which only
+// serves to let the <code>&&</code> and <code>||</code> operators below
+// recognize criteria: a class <code>C</code> that is a criterion is derived
+// from <code>RefinementCriterion@<C@></code>.
+template <class Derived>
+struct RefinementCriterion
+{
+  const Derived &derived () const
+  {
+    return static_cast<const Derived &>(*this);
+  }
+};
+
+
+
+template <class A, class B>
+struct AndCriterion : RefinementCriterion<AndCriterion<A,B> >
+{
+  AndCriterion (const A &a, const B &b) : a (a), b (b) {}
+
+  template <typename Number>
+  Number operator() (const CellGeometry<Number> &cell) const
+  {
+    return std::min (a(cell), b(cell));
+  }
+
+  const A a;
+  const B b;
+};
+
+
+
+template <class A, class B>
+struct OrCriterion : RefinementCriterion<OrCriterion<A,B> >
+{
+  OrCriterion (const A &a, const B &b) : a (a), b (b) {}
+
+  template <typename Number>
+  Number operator() (const CellGeometry<Number> &cell) const
+  {
+    return std::max (a(cell), b(cell));
+  }
+
+  const A a;
+  const B b;
+};
+
+
+
+template <class A, class B>
+AndCriterion<A,B> operator && (const RefinementCriterion<A> &a,
+                               const RefinementCriterion<B> &b)
+{
+  return AndCriterion<A,B> (a.derived(), b.derived());
+}
+
+
+
+template <class A, class B>
+OrCriterion<A,B> operator || (const RefinementCriterion<A> &a,
+                              const RefinementCriterion<B> &b)
+{
+  return OrCriterion<A,B> (a.derived(), b.derived());
+}
+
+
+
+// Two criteria to build from. The first refines cells that have a vertex
+// within a given distance of a circle; with the default distance, this is
+// the test of mark_inner_boundary_cells(). The second refines cells that
+// are coarser than a given level, which is useful to limit the first:
+struct NearCircle : RefinementCriterion<NearCircle>
+{
+  NearCircle (const Point<2> &center,
+              const double    radius,
+              const double    distance = 1e-10)
+    : center (center), radius (radius), distance (distance) {}
+
+  template <typename Number>
+  Number operator() (const CellGeometry<Number> &cell) const
+  {
+    Number value = vertex_value (cell.x[0], cell.y[0]);
+    for (unsigned int v=1; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      value = std::max (value, vertex_value (cell.x[v], cell.y[v]));
+    return value;
+  }
+
+  template <typename Number>
+  Number vertex_value (const Number &x, const Number &y) const
+  {
+    const Number dx = x - center[0],
+                 dy = y - center[1];
+    return distance - std::abs (std::sqrt (dx*dx + dy*dy) - radius);
+  }
+
+  const Point<2> center;
+  const double   radius;
+  const double   distance;
+};
+
+
+
+struct CoarserThan : RefinementCriterion<CoarserThan>
+{
+  CoarserThan (const unsigned int level) : level (level) {}
+
+  template <typename Number>
+  Number operator() (const CellGeometry<Number> &cell) const
+  {
+    return (level - 0.5) - cell.level;
+  }
+
+  const unsigned int level;
+};
+
+
+
+// With these, the cells that touch the inner circle of second_grid() but
+// are not yet finer than level eight are marked by
+// @code
+//   mark_cells_where (triangulation,
+//                     NearCircle (center, inner_radius) && CoarserThan (8));
+// @endcode
+//
+// The first marking function evaluates a criterion on one cell at a time.
+// It is the one to use if a criterion only exists for
+// <code>double</code>. Filling a CellGeometry object from a cell is put
+// into a function of its own since the benchmarks below need it as well:
+void get_cell_geometry (const Triangulation<2>::active_cell_iterator &cell,
+                        CellGeometry<double>                         &geometry)
+{
+  for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+    {
+      geometry.x[v] = cell->vertex(v)[0];
+      geometry.y[v] = cell->vertex(v)[1];
+    }
+  geometry.level = cell->level();
+}
+
+
+
+template <class Criterion>
+void mark_cells_where (Triangulation<2>                     &triangulation,
+                       const RefinementCriterion<Criterion> &criterion)
+{
+  CellGeometry<double> geometry;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    {
+      get_cell_geometry (cell, geometry);
+
+      if (criterion.derived()(geometry) > 0)
+        cell->set_refine_flag ();
+    }
+}
+
+
+
+// The second one works like compute_mesh_quality(): it splits the active
+// cells into chunks that are processed as tasks, and in each chunk it
+// evaluates the criterion on as many cells at a time as a VectorizedArray
+// has lanes. The answers are stored one byte per cell, which different
+// threads can write to without interfering with each other (unlike the
+// bits of the std::vector@<bool@> in which the triangulation stores its
+// flags), and the flags are set afterwards on this thread. If a subdomain
+// is given, only the cells in it are considered.
+//
+// All of this except for the evaluation itself is the same for the other
+// marking functions further down, and is done by the following function:
+// it calls <code>evaluate_chunk(cells, begin, end, refine)</code> for each
+// chunk of cells on a task of its own. Most of these functions answer the
+// question for one cell at a time; for them, mark_cells_in_parallel()
+// turns a function of a single cell into such a chunk function.
+template <class ChunkEvaluator>
+void mark_cells_in_chunks (Triangulation<2>         &triangulation,
+                           const ChunkEvaluator     &evaluate_chunk,
+                           const types::subdomain_id subdomain
+                           = numbers::invalid_subdomain_id)
+{
+  std::vector<Triangulation<2>::active_cell_iterator> cells;
+  cells.reserve (triangulation.n_active_cells());
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (is_in_subdomain (cell, subdomain))
+      cells.push_back (cell);
+
+  const unsigned int n_cells    = cells.size();
+  const unsigned int chunk_size = 4096;
+  std::vector<unsigned char> refine (n_cells, 0);
+
+  Threads::TaskGroup<void> tasks;
+  for (unsigned int begin=0; begin<n_cells; begin+=chunk_size)
+    tasks += Threads::new_task (std::function<void ()> ([&, begin] ()
+    {
+      evaluate_chunk (cells, begin, std::min (begin+chunk_size, n_cells),
+                      refine);
+    }));
+  tasks.join_all ();
+
+  for (unsigned int i=0; i<n_cells; ++i)
+    if (refine[i])
+      cells[i]->set_refine_flag ();
+}
+
+
+
+template <class CellPredicate>
+void mark_cells_in_parallel (Triangulation<2>         &triangulation,
+                             const CellPredicate      &refine_cell,
+                             const types::subdomain_id subdomain
+                             = numbers::invalid_subdomain_id)
+{
+  mark_cells_in_chunks
+  (triangulation,
+   [&] (const std::vector<Triangulation<2>::active_cell_iterator> &cells,
+        const unsigned int                                         begin,
+        const unsigned int                                         end,
+        std::vector<unsigned char>                                &refine)
+  {
+    for (unsigned int i=begin; i<end; ++i)
+      refine[i] = refine_cell (cells[i]);
+  },
+  subdomain);
+}
+
+
+
+template <class Criterion>
+void evaluate_criterion_on_cells
+(const Criterion                                           &criterion,
+ const std::vector<Triangulation<2>::active_cell_iterator> &cells,
+ const unsigned int                                         begin,
+ const unsigned int                                         end,
+ std::vector<unsigned char>                                &refine)
+{
+  typedef VectorizedArray<double> VectorizedDouble;
+  const unsigned int n_lanes = VectorizedDouble::n_array_elements;
+
+  CellGeometry<VectorizedDouble> geometry;
+  for (unsigned int batch=begin; batch<end; batch+=n_lanes)
+    {
+      for (unsigned int lane=0; lane<n_lanes; ++lane)
+        {
+          const Triangulation<2>::active_cell_iterator &cell
+            = cells[std::min (batch+lane, end-1)];
+          for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+            {
+              geometry.x[v][lane] = cell->vertex(v)[0];
+              geometry.y[v][lane] = cell->vertex(v)[1];
+            }
+          geometry.level[lane] = cell->level();
+        }
+
+      const VectorizedDouble value = criterion (geometry);
+      for (unsigned int lane=0; lane<std::min (n_lanes, end-batch); ++lane)
+        refine[batch+lane] = (value[lane] > 0);
+    }
+}
+
+
+
+template <class Criterion>
+void mark_cells_where_in_parallel (Triangulation<2>                     &triangulation,
+                                   const RefinementCriterion<Criterion> &criterion,
+                                   const types::subdomain_id             subdomain
+                                   = numbers::invalid_subdomain_id)
+{
+  TraceScope trace_scope ("mark cells by criterion");
+
+  mark_cells_in_chunks
+  (triangulation,
+   [&] (const std::vector<Triangulation<2>::active_cell_iterator> &cells,
+        const unsigned int                                         begin,
+        const unsigned int                                         end,
+        std::vector<unsigned char>                                &refine)
+  {
+    evaluate_criterion_on_cells (criterion.derived(), cells, begin, end,
+                                 refine);
+  },
+  subdomain);
+}
+
+
+
+// @sect4{Refining toward a cloud of points}
+
+// In many applications, what the mesh has to resolve is not given by a
+// formula like the circle above, but by a set of points: measurements,
+// features detected in an image, particles. The following strategy
+// refines every active cell whose distance from one of the points of a
+// given set is at most a tolerance; with a tolerance of zero, these are
+// the cells that contain a point. We measure the distance to the
+// quadrilateral spanned by the vertices of the cell, using
+// distance_to_cell_hull() from above.
+//
+// Testing every cell against every point is out of the question for
+// thousands of cells and millions of points. We therefore sort the points
+// into a k-d tree once: the root of the tree holds all points and the box
+// bounding them; it is split into two halves with equally many points at
+// the median coordinate in the direction in which the box is widest, and
+// so on, until a node holds no more than <code>leaf_size</code> points.
+// The nodes are stored in an array, the points in an order in which the
+// points of each node are consecutive, so a node only needs to know the
+// range of its points and where its first child is; the second child is
+// stored right after the first.
+//
+// To find whether any point is close to a cell, we walk down the tree and
+// skip every node whose box does not intersect the bounding box of the
+// cell enlarged by the tolerance; only the points of the leaves that
+// remain are tested against the cell itself. Since the points are
+// distributed over nodes of geometrically shrinking size, this visits
+// $O(\log N)$ nodes for $N$ points plus the nodes near the cell, and
+// marking all cells costs $O(n \log N)$ for $n$ cells rather than $O(nN)$.
+class PointCloud
+{
+public:
+  PointCloud (const std::vector<Point<2> > &points);
+
+  bool has_point_near (const Triangulation<2>::active_cell_iterator &cell,
+                       const double                                  tolerance) const;
+
+  unsigned int size () const
+  {
+    return points.size();
+  }
+
+  static const unsigned int leaf_size = 16;
+
+private:
+  struct Node
+  {
+    Point<2>     lower_corner;
+    Point<2>     upper_corner;
+    unsigned int begin;
+    unsigned int end;
+    unsigned int first_child;
+  };
+
+  void build (const unsigned int node);
+
+  std::vector<Point<2> > points;
+  std::vector<Node>      nodes;
+};
+
+
+
+PointCloud::PointCloud (const std::vector<Point<2> > &points)
+  :
+  points (points)
+{
+  AssertThrow (points.size() > 0,
+               ExcMessage ("A point cloud needs at least one point."));
+
+  nodes.reserve (4 * points.size() / leaf_size + 1);
+  nodes.push_back (Node());
+  nodes[0].begin = 0;
+  nodes[0].end   = points.size();
+  build (0);
+}
+
+
+
+// Building the tree computes the box of a node, and if the node has too
+// many points, partitions them around the median with
+// <code>std::nth_element</code>, which takes time linear in the number
+// of points. The whole tree is therefore built in $O(N \log N)$ time.
+// Note that <code>nodes</code> may grow while we work on one of its
+// elements, so we access them by index rather than by reference:
+void PointCloud::build (const unsigned int node)
+{
+  const unsigned int begin = nodes[node].begin,
+                     end   = nodes[node].end;
+
+  Point<2> lower_corner = points[begin],
+           upper_corner = points[begin];
+  for (unsigned int i=begin+1; i<end; ++i)
+    for (unsigned int d=0; d<2; ++d)
+      {
+        lower_corner[d] = std::min (lower_corner[d], points[i][d]);
+        upper_corner[d] = std::max (upper_corner[d], points[i][d]);
+      }
+  nodes[node].lower_corner = lower_corner;
+  nodes[node].upper_corner = upper_corner;
+  nodes[node].first_child  = 0;
+
+  if (end - begin <= leaf_size)
+    return;
+
+  const unsigned int direction
+    = ((upper_corner[0] - lower_corner[0] >= upper_corner[1] - lower_corner[1])
+       ? 0 : 1);
+  const unsigned int middle = (begin + end) / 2;
+  std::nth_element (points.begin() + begin,
+                    points.begin() + middle,
+                    points.begin() + end,
+                    [direction] (const Point<2> &a, const Point<2> &b)
+  {
+    return a[direction] < b[direction];
+  });
+
+  const unsigned int first_child = nodes.size();
+  nodes[node].first_child = first_child;
+  nodes.push_back (Node());
+  nodes.push_back (Node());
+  nodes[first_child].begin   = begin;
+  nodes[first_child].end     = middle;
+  nodes[first_child+1].begin = middle;
+  nodes[first_child+1].end   = end;
+
+  build (first_child);
+  build (first_child+1);
+}
+
+
+
+bool
+PointCloud::has_point_near (const Triangulation<2>::active_cell_iterator &cell,
+                            const double                                  tolerance) const
+{
+  Point<2> lower_corner = cell->vertex(0),
+           upper_corner = cell->vertex(0);
+  for (unsigned int v=1; v<GeometryInfo<2>::vertices_per_cell; ++v)
+    for (unsigned int d=0; d<2; ++d)
+      {
+        lower_corner[d] = std::min (lower_corner[d], cell->vertex(v)[d]);
+        upper_corner[d] = std::max (upper_corner[d], cell->vertex(v)[d]);
+      }
+  for (unsigned int d=0; d<2; ++d)
+    {
+      lower_corner[d] -= tolerance;
+      upper_corner[d] += tolerance;
+    }
+
+  const auto intersects_query_box = [&] (const Point<2> &lower,
+                                         const Point<2> &upper)
+  {
+    return ((lower[0] <= upper_corner[0]) && (upper[0] >= lower_corner[0])
+            &&
+            (lower[1] <= upper_corner[1]) && (upper[1] >= lower_corner[1]));
+  };
+
+  // The nodes still to be looked at. The tree is balanced, so the stack
+  // never holds more nodes than the tree has levels, which is less than 32
+  // for any number of points an <code>unsigned int</code> can count:
+  unsigned int stack[64];
+  unsigned int stack_size = 0;
+  stack[stack_size++] = 0;
+  while (stack_size > 0)
+    {
+      const Node &node = nodes[stack[--stack_size]];
+
+      if (!intersects_query_box (node.lower_corner, node.upper_corner))
+        continue;
+
+      if (node.first_child != 0)
+        {
+          stack[stack_size++] = node.first_child;
+          stack[stack_size++] = node.first_child+1;
+        }
+      else
+        for (unsigned int i=node.begin; i<node.end; ++i)
+          if (intersects_query_box (points[i], points[i])
+              &&
+              (distance_to_cell_hull (cell, points[i]) <= tolerance))
+            return true;
+    }
+  return false;
+}
+
+
+
+// The points are read from a text file with one point per line, given by
+// its two coordinates. Files with millions of points are read like the
+// meshes above: the file is mapped into memory and its lines parsed on
+// several threads.
+PointCloud read_point_cloud (const std::string &filename)
+{
+  TraceScope trace_scope ("read point cloud");
+
+  const MappedFile file (filename);
+  const std::vector<Point<2> > points
+    = parse_lines_in_parallel<Point<2> >
+      (file.begin(), file.end(),
+       [] (const char *&p, const char *end)
+  {
+    const double x = read_double (p, end);
+    const double y = read_double (p, end);
+    return Point<2> (x, y);
+  });
+
+  return PointCloud (points);
+}
+
+
+
+// The queries for different cells are independent, and are done for
+// chunks of cells on separate tasks by mark_cells_in_parallel():
+void mark_cells_near_points (Triangulation<2> &triangulation,
+                             const PointCloud &point_cloud,
+                             const double      tolerance)
+{
+  TraceScope trace_scope ("mark cells near points");
+
+  mark_cells_in_parallel (triangulation,
+                          [&] (const Triangulation<2>::active_cell_iterator &cell)
+  {
+    return point_cloud.has_point_near (cell, tolerance);
+  });
+}
+
+
+
+// @sect4{Refining toward implicit surfaces}
+
+// A surface, or in 2d a curve, can also be described implicitly by a
+// <i>signed distance function</i> $\phi$: $|\phi(x)|$ is the distance of
+// $x$ from the curve, and the sign tells on which side of it $x$ lies
+// (negative inside). The curve is where $\phi=0$. The circle of
+// second_grid() is described by $\phi(x) = |x-c| - r$, but shapes of any
+// complexity can be described this way, for example by combining simple
+// ones: the minimum of two such functions describes the union of the two
+// shapes, the maximum their intersection, and $\max(\phi_A, -\phi_B)$ the
+// part of $A$ outside of $B$. (The result is then not exactly the
+// distance any more everywhere, but still has the correct sign and is
+// never larger in magnitude than the distance, which is all we need.)
+// Alternatively, $\phi$ may be known only at the points of a regular grid,
+// for example when it was computed from an image or from a level set
+// method, and is then interpolated between them.
+//
+// We refine a cell if $\phi$ changes sign between its vertices, i.e. the
+// curve passes through it, or if the smallest $|\phi|$ at its vertices is
+// less than <code>--band-width</code> times the diameter of the cell. The
+// latter adds a band of cells along the curve whose width is proportional
+// to the size of the cells, and catches cells the curve enters and leaves
+// between two vertices.
+//
+// Signed distance functions are implemented like the refinement
+// criteria above: as classes with a templated <code>operator()</code> that
+// can be evaluated for <code>double</code> and VectorizedArray<double>,
+// derived from a class template that lets the operators for combining them
+// recognize them, so that a composite function is a single inlined
+// expression. The union of two shapes is written <code>a | b</code>, their
+// intersection <code>a & b</code>, and the difference <code>a - b</code>.
+template <class Derived>
+struct SignedDistance
+{
+  const Derived &derived () const
+  {
+    return static_cast<const Derived &>(*this);
+  }
+};
+
+
+
+struct CircleDistance : SignedDistance<CircleDistance>
+{
+  CircleDistance (const Point<2> &center,
+                  const double    radius)
+    : center (center), radius (radius) {}
+
+  template <typename Number>
+  Number operator() (const Number &x, const Number &y) const
+  {
+    const Number dx = x - center[0],
+                 dy = y - center[1];
+    return std::sqrt (dx*dx + dy*dy) - radius;
+  }
+
+  const Point<2> center;
+  const double   radius;
+};
+
+
+
+// The distance function of an axis-parallel rectangle: outside of it, the
+// distance from its closest point; inside, minus the distance from its
+// closest side.
+struct BoxDistance : SignedDistance<BoxDistance>
+{
+  BoxDistance (const Point<2> &lower_corner,
+               const Point<2> &upper_corner)
+    : lower_corner (lower_corner), upper_corner (upper_corner) {}
+
+  template <typename Number>
+  Number operator() (const Number &x, const Number &y) const
+  {
+    const Number dx = std::max (lower_corner[0] - x, x - upper_corner[0]),
+                 dy = std::max (lower_corner[1] - y, y - upper_corner[1]);
+    Number zero;
+    zero = 0.;
+    const Number outside_x = std::max (dx, zero),
+                 outside_y = std::max (dy, zero);
+    return (std::sqrt (outside_x*outside_x + outside_y*outside_y)
+            + std::min (std::max (dx, dy), zero));
+  }
+
+  const Point<2> lower_corner;
+  const Point<2> upper_corner;
+};
+
+
+
+template <class A, class B>
+struct UnionDistance : SignedDistance<UnionDistance<A,B> >
+{
+  UnionDistance (const A &a, const B &b) : a (a), b (b) {}
+
+  template <typename Number>
+  Number operator() (const Number &x, const Number &y) const
+  {
+    return std::min (a(x,y), b(x,y));
+  }
+
+  const A a;
+  const B b;
+};
+
+
+
+template <class A, class B>
+struct IntersectionDistance : SignedDistance<IntersectionDistance<A,B> >
+{
+  IntersectionDistance (const A &a, const B &b) : a (a), b (b) {}
+
+  template <typename Number>
+  Number operator() (const Number &x, const Number &y) const
+  {
+    return std::max (a(x,y), b(x,y));
+  }
+
+  const A a;
+  const B b;
+};
+
+
+
+template <class A, class B>
+struct DifferenceDistance : SignedDistance<DifferenceDistance<A,B> >
+{
+  DifferenceDistance (const A &a, const B &b) : a (a), b (b) {}
+
+  template <typename Number>
+  Number operator() (const Number &x, const Number &y) const
+  {
+    return std::max (a(x,y), -b(x,y));
+  }
+
+  const A a;
+  const B b;
+};
+
+
+
+template <class A, class B>
+UnionDistance<A,B> operator | (const SignedDistance<A> &a,
+                               const SignedDistance<B> &b)
+{
+  return UnionDistance<A,B> (a.derived(), b.derived());
+}
+
+
+
+template <class A, class B>
+IntersectionDistance<A,B> operator & (const SignedDistance<A> &a,
+                                      const SignedDistance<B> &b)
+{
+  return IntersectionDistance<A,B> (a.derived(), b.derived());
+}
+
+
+
+template <class A, class B>
+DifferenceDistance<A,B> operator - (const SignedDistance<A> &a,
+                                    const SignedDistance<B> &b)
+{
+  return DifferenceDistance<A,B> (a.derived(), b.derived());
+}
+
+
+
+// The example surface used if no file is given: a circle halfway between
+// the inner and outer boundary of the ring of second_grid(), with a
+// rectangular notch cut into its top and a second, smaller circle added to
+// its right. Because the functions are combined as template expressions,
+// the type of this object spells out the whole expression:
+typedef UnionDistance<DifferenceDistance<CircleDistance,BoxDistance>,
+        CircleDistance> ExampleSurface;
+
+ExampleSurface example_surface (const Point<2> &center)
+{
+  const Tensor<1,2> up    = Point<2> (0, 1),
+                    right = Point<2> (1, 0);
+  return ((CircleDistance (center, 0.75)
+           - BoxDistance (center + 0.6*up - 0.1*right,
+                          center + 0.9*up + 0.1*right))
+          | CircleDistance (center + 0.75*right, 0.1));
+}
+
+
+
+// The interpolated signed distance function stores its values at the
+// points of a grid of $n_x \times n_y$ points covering a rectangle,
+// row by row, and interpolates bilinearly between the four grid points
+// around a point. Outside of the rectangle, it uses the values at its
+// boundary; the grid should therefore cover the whole mesh.
+//
+// With VectorizedArray<double>, the points of the different lanes lie in
+// different grid cells, and the values have to be collected lane by lane;
+// the interpolation itself is then done for all lanes at once. The
+// following two pairs of functions let us write this once for both
+// <code>double</code> and VectorizedArray<double>:
+inline unsigned int n_lanes_of (const double &)
+{
+  return 1;
+}
+
+
+inline unsigned int n_lanes_of (const VectorizedArray<double> &)
+{
+  return VectorizedArray<double>::n_array_elements;
+}
+
+
+inline double &lane (double &x, const unsigned int)
+{
+  return x;
+}
+
+
+inline double &lane (VectorizedArray<double> &x, const unsigned int l)
+{
+  return x[l];
+}
+
+
+
+class SampledDistance : public SignedDistance<SampledDistance>
+{
+public:
+  SampledDistance (const unsigned int         n_x,
+                   const unsigned int         n_y,
+                   const Point<2>            &lower_corner,
+                   const Point<2>            &upper_corner,
+                   const std::vector<double> &values);
+
+  template <typename Number>
+  Number operator() (const Number &x, const Number &y) const;
+
+private:
+  const unsigned int  n_x;
+  const unsigned int  n_y;
+  const Point<2>      lower_corner;
+  const double        spacing_x;
+  const double        spacing_y;
+  std::vector<double> values;
+};
+
+
+
+SampledDistance::SampledDistance (const unsigned int         n_x,
+                                  const unsigned int         n_y,
+                                  const Point<2>            &lower_corner,
+                                  const Point<2>            &upper_corner,
+                                  const std::vector<double> &values)
+  :
+  n_x (n_x),
+  n_y (n_y),
+  lower_corner (lower_corner),
+  spacing_x ((upper_corner[0] - lower_corner[0]) / (n_x - 1)),
+  spacing_y ((upper_corner[1] - lower_corner[1]) / (n_y - 1)),
+  values (values)
+{
+  AssertThrow ((n_x >= 2) && (n_y >= 2),
+               ExcMessage ("A sampled signed distance function needs at "
+                           "least two grid points in each direction."));
+  AssertThrow ((spacing_x > 0) && (spacing_y > 0),
+               ExcMessage ("The grid of a sampled signed distance function "
+                           "must cover a rectangle of positive size."));
+  AssertThrow (values.size() == n_x * n_y,
+               ExcMessage ("A sampled signed distance function on a grid of "
+                           + Utilities::int_to_string (n_x) + "x"
+                           + Utilities::int_to_string (n_y) + " points needs "
+                           + Utilities::int_to_string (n_x * n_y)
+                           + " values, but got "
+                           + Utilities::int_to_string (values.size()) + "."));
+}
+
+
+
+template <typename Number>
+Number SampledDistance::operator() (const Number &x, const Number &y) const
+{
+  Number s = (x - lower_corner[0]) / spacing_x,
+         t = (y - lower_corner[1]) / spacing_y;
+  Number value_00, value_10, value_01, value_11;
+  for (unsigned int l=0; l<n_lanes_of (s); ++l)
+    {
+      const double s_l = std::max (0., std::min (lane (s, l), n_x - 1.)),
+                   t_l = std::max (0., std::min (lane (t, l), n_y - 1.));
+      const unsigned int i = std::min (static_cast<unsigned int>(s_l), n_x-2),
+                         j = std::min (static_cast<unsigned int>(t_l), n_y-2);
+      lane (s, l) = s_l - i;
+      lane (t, l) = t_l - j;
+
+      const double *const corner = &values[j*n_x + i];
+      lane (value_00, l) = corner[0];
+      lane (value_10, l) = corner[1];
+      lane (value_01, l) = corner[n_x];
+      lane (value_11, l) = corner[n_x+1];
+    }
+
+  return ((1.-t) * ((1.-s) * value_00 + s * value_10)
+          + t * ((1.-s) * value_01 + s * value_11));
+}
+
+
+
+// A sampled signed distance function is read from a text file whose first
+// line contains $n_x$, $n_y$, and the coordinates of the lower left and
+// upper right corner of the rectangle, followed by the $n_x n_y$ values,
+// row by row from the bottom, in any arrangement of lines:
+SampledDistance read_sampled_distance (const std::string &filename)
+{
+  const MappedFile file (filename);
+  const char *p = file.begin();
+  const char *const end = file.end();
+
+  const long n_x = read_integer (p, end),
+             n_y = read_integer (p, end);
+  AssertThrow ((n_x >= 2) && (n_y >= 2),
+               ExcMessage ("The file <" + filename + "> does not start with "
+                           "the size of a grid of at least 2x2 points."));
+  Point<2> lower_corner, upper_corner;
+  lower_corner[0] = read_double (p, end);
+  lower_corner[1] = read_double (p, end);
+  upper_corner[0] = read_double (p, end);
+  upper_corner[1] = read_double (p, end);
+
+  std::vector<double> values (n_x * n_y);
+  for (unsigned int i=0; i<values.size(); ++i)
+    values[i] = read_double (p, end);
+
+  return SampledDistance (n_x, n_y, lower_corner, upper_corner, values);
+}
+
+
+
+// Marking cells then happens in two passes. Every vertex belongs to up to
+// four cells, so rather than evaluating the signed distance function four
+// times per cell, we first evaluate it once at every vertex of the
+// triangulation, for as many vertices at a time as a VectorizedArray has
+// lanes, and in chunks of vertices on separate tasks. The second pass
+// looks at the four values of each cell, again in chunks on separate tasks
+// using mark_cells_in_parallel().
+template <class SDF>
+void evaluate_at_vertices (const Triangulation<2>    &triangulation,
+                           const SignedDistance<SDF> &signed_distance,
+                           std::vector<double>       &values)
+{
+  typedef VectorizedArray<double> VectorizedDouble;
+  const unsigned int n_lanes = VectorizedDouble::n_array_elements;
+
+  const std::vector<Point<2> > &vertices = triangulation.get_vertices();
+  const unsigned int n_vertices = vertices.size();
+  const unsigned int chunk_size = 4096;
+  values.resize (n_vertices);
+
+  Threads::TaskGroup<void> tasks;
+  for (unsigned int begin=0; begin<n_vertices; begin+=chunk_size)
+    tasks += Threads::new_task (std::function<void ()> ([&, begin] ()
+    {
+      const unsigned int end = std::min (begin+chunk_size, n_vertices);
+      for (unsigned int batch=begin; batch<end; batch+=n_lanes)
+        {
+          VectorizedDouble x, y;
+          for (unsigned int l=0; l<n_lanes; ++l)
+            {
+              const Point<2> &vertex = vertices[std::min (batch+l, end-1)];
+              x[l] = vertex[0];
+              y[l] = vertex[1];
+            }
+
+          const VectorizedDouble value = signed_distance.derived() (x, y);
+          for (unsigned int l=0; l<std::min (n_lanes, end-batch); ++l)
+            values[batch+l] = value[l];
+        }
+    }));
+  tasks.join_all ();
+}
+
+
+
+inline bool is_near_surface (const double values[4],
+                             const double diameter,
+                             const double band_width)
+{
+  const double min_value = std::min (std::min (values[0], values[1]),
+                                     std::min (values[2], values[3])),
+               max_value = std::max (std::max (values[0], values[1]),
+                                     std::max (values[2], values[3]));
+  const double min_distance = std::min (std::min (std::fabs (values[0]),
+                                                  std::fabs (values[1])),
+                                        std::min (std::fabs (values[2]),
+                                                  std::fabs (values[3])));
+  return (((min_value <= 0) && (max_value >= 0))
+          ||
+          (min_distance < band_width * diameter));
+}
+
+
+
+template <class SDF>
+void mark_cells_near_surface (Triangulation<2>          &triangulation,
+                              const SignedDistance<SDF> &signed_distance,
+                              const double               band_width)
+{
+  TraceScope trace_scope ("mark cells near surface");
+
+  std::vector<double> values;
+  evaluate_at_vertices (triangulation, signed_distance, values);
+
+  mark_cells_in_parallel (triangulation,
+                          [&] (const Triangulation<2>::active_cell_iterator &cell)
+  {
+    double cell_values[4];
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      cell_values[v] = values[cell->vertex_index(v)];
+    return is_near_surface (cell_values, cell->diameter(), band_width);
+  });
+}
+
+
+
+// @sect4{Putting the strategies together}
+
+// Finally, the class that second_grid() uses in each refinement step to
+// mark cells, using whichever of the strategies above was requested on the
+// command line. Some of the strategies keep data from one refinement step
+// to the next (such as the vertex-to-cell map above); this class owns it.
+class RefinementMarker
+{
+public:
+  RefinementMarker (Triangulation<2>     &triangulation,
+                    const Point<2>       &center,
+                    const double          inner_radius,
+                    const ProgramOptions &options);
+
+  void mark_cells ();
+
+private:
+  Triangulation<2>                 &triangulation;
+  const Point<2>                    center;
+  const double                      inner_radius;
+  const ProgramOptions             &options;
+
+  std::unique_ptr<VertexToCellMap>            vertex_to_cell_map;
+  std::unique_ptr<VertexClassificationCache>  vertex_classification;
+  std::unique_ptr<PointCloud>                 point_cloud;
+  std::unique_ptr<SampledDistance>            sampled_distance;
+};
+
+
+
+RefinementMarker::RefinementMarker (Triangulation<2>     &triangulation,
+                                    const Point<2>       &center,
+                                    const double          inner_radius,
+                                    const ProgramOptions &options)
+  :
+  triangulation (triangulation),
+  center (center),
+  inner_radius (inner_radius),
+  options (options)
+{
+  if (options.refinement_strategy == RefinementStrategy::vertex_centric)
+    vertex_to_cell_map.reset (new VertexToCellMap (triangulation));
+  if (options.refinement_strategy == RefinementStrategy::cached)
+    vertex_classification.reset (new VertexClassificationCache (triangulation));
+  if (options.refinement_strategy == RefinementStrategy::point_cloud)
+    {
+      AssertThrow (!options.point_cloud_file.empty(),
+                   ExcMessage ("The point-cloud refinement strategy needs a "
+                               "file of points given with --points=file."));
+      point_cloud.reset (new PointCloud (read_point_cloud (options.point_cloud_file)));
+      std::cout << "Read " << point_cloud->size() << " points from "
+                << options.point_cloud_file << std::endl;
+    }
+  if ((options.refinement_strategy == RefinementStrategy::signed_distance)
+      &&
+      !options.signed_distance_file.empty())
+    sampled_distance.reset (new SampledDistance
+                            (read_sampled_distance (options.signed_distance_file)));
+}
+
+
+
+void RefinementMarker::mark_cells ()
+{
+  switch (options.refinement_strategy)
+    {
+    case RefinementStrategy::inner_boundary:
+      mark_inner_boundary_cells (triangulation, center, inner_radius);
+      break;
+
+    case RefinementStrategy::fixed_number:
+    case RefinementStrategy::fixed_fraction:
+      mark_cells_by_indicator (triangulation, center, inner_radius, options);
+      break;
+
+    case RefinementStrategy::vertex_centric:
+      mark_cells_at_circle_vertices (triangulation, *vertex_to_cell_map,
+                                     center, inner_radius);
+      break;
+
+    case RefinementStrategy::hierarchical:
+      mark_inner_boundary_cells_hierarchically (triangulation, center,
+                                                inner_radius);
+      break;
+
+    case RefinementStrategy::cached:
+    {
+      vertex_classification->reset_statistics ();
+      mark_inner_boundary_cells_cached (triangulation, *vertex_classification,
+                                        center, inner_radius);
+      const unsigned long n_lookups = vertex_classification->n_hits()
+                                      + vertex_classification->n_misses();
+      std::cout << "  Vertex cache: " << vertex_classification->n_misses()
+                << " vertices classified, hit rate "
+                << 100. * vertex_classification->n_hits()
+                / std::max (n_lookups, 1ul)
+                << "%" << std::endl;
+      break;
+    }
+
+    case RefinementStrategy::point_cloud:
+      mark_cells_near_points (triangulation, *point_cloud,
+                              options.point_tolerance);
+      break;
+
+    case RefinementStrategy::signed_distance:
+      if (sampled_distance)
+        mark_cells_near_surface (triangulation, *sampled_distance,
+                                 options.surface_band_width);
+      else
+        mark_cells_near_surface (triangulation, example_surface (center),
+                                 options.surface_band_width);
+      break;
+
+    default:
+      Assert (false, ExcNotImplemented());
+    }
+}
+
+
+
+// @sect3{Generating many ring meshes at once}
+
+// Applications that need not just one but thousands of ring meshes, with
+// different centers, radii, and numbers of cells, would pay for starting a
+// process for each of them and would generate them one after the other.
+// The functions in this section instead take a list of configurations and
+// generate all of the meshes in parallel. Each configuration is described
+// by the following structure:
+struct RingConfiguration
+{
+  Point<2>     center;
+  double       inner_radius;
+  double       outer_radius;
+  unsigned int n_circumferential_cells;
+  unsigned int n_refinement_steps;
+};
+
+
+
+// Configurations can be read from a file in which each line contains the
+// six numbers of one RingConfiguration, in the order in which they are
+// declared above. Empty lines and lines starting with a '#' are ignored.
+std::vector<RingConfiguration>
+read_ring_configurations (const std::string &filename)
+{
+  std::ifstream in (filename.c_str());
+  AssertThrow (in, ExcMessage ("Could not open configuration file <"
+                               + filename + ">."));
+
+  std::vector<RingConfiguration> configurations;
+  std::string line;
+  while (std::getline (in, line))
+    {
+      if (line.empty() || (line[0] == '#'))
+        continue;
+
+      std::istringstream line_stream (line);
+      RingConfiguration configuration;
+      line_stream >> configuration.center[0] >> configuration.center[1]
+                  >> configuration.inner_radius >> configuration.outer_radius
+                  >> configuration.n_circumferential_cells
+                  >> configuration.n_refinement_steps;
+      AssertThrow (line_stream && (configuration.inner_radius > 0)
+                   && (configuration.inner_radius < configuration.outer_radius),
+                   ExcMessage ("Invalid ring configuration <" + line + ">."));
+
+      configurations.push_back (configuration);
+    }
+
+  return configurations;
+}
+
+
+
+// Generating one mesh works exactly as in second_grid(), except that all
+// parameters come from the configuration and that we hand the result to a
+// callback instead of writing it to a fixed file. The callback is given
+// the index of the configuration so that it can, for example, choose a
+// file name.
+typedef std::function<void (const unsigned int,
+                            const RingConfiguration &,
+                            const Triangulation<2> &)>
+RingMeshCallback;
+
+
+void generate_ring_mesh (const unsigned int       index,
+                         const RingConfiguration &configuration,
+                         const RingMeshCallback  &callback)
+{
+  TraceScope trace_scope ("generate ring mesh");
+  const SphericalManifold<2> manifold_description(configuration.center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation,
+               configuration.center,
+               configuration.inner_radius,
+               configuration.outer_radius,
+               configuration.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+
+  for (unsigned int step=0; step<configuration.n_refinement_steps; ++step)
+    {
+      mark_inner_boundary_cells (triangulation, configuration.center,
+                                 configuration.inner_radius);
+      triangulation.execute_coarsening_and_refinement ();
+    }
+
+  callback (index, configuration, triangulation);
+}
+
+
+
+// The batch function itself creates one task per configuration. deal.II
+// runs tasks through the Threading Building Blocks, whose scheduler keeps a
+// queue of tasks per thread and lets idle threads steal work from busy
+// ones; this balances the load even if some of the meshes are much larger
+// than others. Since the callback is called from several threads at once,
+// it has to be thread-safe. The function returns the number of meshes
+// generated per second of wall time.
+double generate_ring_meshes (const std::vector<RingConfiguration> &configurations,
+                             const RingMeshCallback               &callback)
+{
+  Timer timer;
+
+  Threads::TaskGroup<void> tasks;
+  for (unsigned int i=0; i<configurations.size(); ++i)
+    tasks += Threads::new_task (std::function<void ()>
+                                (std::bind (&generate_ring_mesh,
+                                            i,
+                                            std::cref (configurations[i]),
+                                            std::cref (callback))));
+  tasks.join_all ();
+
+  return configurations.size() / timer.wall_time();
+}
+
+
+
+// @sect3{Checking the quality of the mesh}
+
+// New vertices on the curved parts of the ring are placed by the
+// SphericalManifold object, and after many refinement steps one may want to
+// know whether this has distorted the cells. The following structure
+// collects the relevant statistics: the range of aspect ratios (longest
+// over shortest edge), the smallest interior angle of any cell, and the
+// number of cells at one of whose corners the Jacobian of the bilinear
+// mapping is not positive, i.e., cells that are inverted or degenerate.
+// In addition, it keeps histograms of the aspect ratios and smallest
+// angles.
+struct MeshQualityStatistics
+{
+  static const unsigned int n_bins = 10;
+
+  // The aspect ratio histogram has bins of width 0.5 starting at one (with
+  // everything above 5.5 in the last bin); the angle histogram has bins of
+  // 9 degrees between 0 and 90 degrees.
+  static constexpr double aspect_ratio_bin_width = 0.5;
+  static constexpr double angle_bin_width        = 9;
+
+  MeshQualityStatistics ();
+
+  void add_cell (const double aspect_ratio,
+                 const double min_angle,
+                 const bool   has_positive_jacobian);
+  void merge (const MeshQualityStatistics &other);
+  void print (std::ostream &out) const;
+
+  unsigned int n_cells;
+  double       min_aspect_ratio;
+  double       max_aspect_ratio;
+  double       min_angle;
+  unsigned int n_inverted_cells;
+  unsigned int aspect_ratio_histogram[n_bins];
+  unsigned int min_angle_histogram[n_bins];
+};
+
+
+
+MeshQualityStatistics::MeshQualityStatistics ()
+  :
+  n_cells (0),
+  min_aspect_ratio (std::numeric_limits<double>::max()),
+  max_aspect_ratio (0),
+  min_angle (180),
+  n_inverted_cells (0)
+{
+  std::fill (aspect_ratio_histogram, aspect_ratio_histogram+n_bins, 0u);
+  std::fill (min_angle_histogram, min_angle_histogram+n_bins, 0u);
+}
+
+
+
+void MeshQualityStatistics::add_cell (const double aspect_ratio,
+                                      const double min_angle,
+                                      const bool   has_positive_jacobian)
+{
+  ++n_cells;
+  min_aspect_ratio = std::min (min_aspect_ratio, aspect_ratio);
+  max_aspect_ratio = std::max (max_aspect_ratio, aspect_ratio);
+  this->min_angle  = std::min (this->min_angle, min_angle);
+  if (!has_positive_jacobian)
+    ++n_inverted_cells;
+
+  ++aspect_ratio_histogram[std::min (static_cast<unsigned int>
+                                     ((aspect_ratio-1) / aspect_ratio_bin_width),
+                                     n_bins-1)];
+  ++min_angle_histogram[std::min (static_cast<unsigned int>
+                                  (std::max (min_angle, 0.) / angle_bin_width),
+                                  n_bins-1)];
+}
+
+
+
+void MeshQualityStatistics::merge (const MeshQualityStatistics &other)
+{
+  n_cells          += other.n_cells;
+  min_aspect_ratio  = std::min (min_aspect_ratio, other.min_aspect_ratio);
+  max_aspect_ratio  = std::max (max_aspect_ratio, other.max_aspect_ratio);
+  min_angle         = std::min (min_angle, other.min_angle);
+  n_inverted_cells += other.n_inverted_cells;
+  for (unsigned int b=0; b<n_bins; ++b)
+    {
+      aspect_ratio_histogram[b] += other.aspect_ratio_histogram[b];
+      min_angle_histogram[b]    += other.min_angle_histogram[b];
+    }
+}
+
+
+
+void MeshQualityStatistics::print (std::ostream &out) const
+{
+  out << "    " << n_cells << " cells, aspect ratio in ["
+      << min_aspect_ratio << ',' << max_aspect_ratio
+      << "], smallest angle " << min_angle << " degrees, "
+      << n_inverted_cells << " cells with non-positive Jacobian"
+      << std::endl;
+
+  out << "    aspect ratio histogram (bins of " << aspect_ratio_bin_width
+      << " from 1):";
+  for (unsigned int b=0; b<n_bins; ++b)
+    out << ' ' << aspect_ratio_histogram[b];
+  out << std::endl;
+
+  out << "    smallest angle histogram (bins of " << angle_bin_width
+      << " degrees from 0):";
+  for (unsigned int b=0; b<n_bins; ++b)
+    out << ' ' << min_angle_histogram[b];
+  out << std::endl;
+}
+
+
+
+// The statistics are computed from the four vertices of each cell. For a
+// corner $p$ with neighbors $q$ (next in counter-clockwise order) and $r$
+// (previous), we need the lengths of the edges $a=q-p$ and $b=r-p$, the
+// cosine of the angle between them, and the cross product $a\times b$,
+// which is the Jacobian determinant of the bilinear map at that corner
+// (up to a positive factor). deal.II numbers the vertices of a
+// quadrilateral lexicographically, so going around the cell
+// counter-clockwise means visiting vertices 0, 1, 3, 2.
+//
+// To make this cheap enough to run after every refinement step, we first
+// collect the vertex indices of all active cells into one array. This is
+// the only loop over cell iterators; the metrics are then computed on
+// chunks of this array on separate tasks, and within each chunk for
+// several cells at once using deal.II's VectorizedArray class, which maps
+// the arithmetic onto the SIMD instructions of the processor. Each chunk
+// accumulates its own statistics, which we merge at the end.
+void compute_quality_of_cells (const std::vector<Point<2> >    &vertices,
+                               const std::vector<unsigned int> &cell_vertices,
+                               const unsigned int               begin,
+                               const unsigned int               end,
+                               MeshQualityStatistics           &statistics)
+{
+  TraceScope trace_scope ("mesh quality chunk");
+  typedef VectorizedArray<double> VectorizedDouble;
+  const unsigned int n_lanes = VectorizedDouble::n_array_elements;
+  const unsigned int corners[4] = { 0, 1, 3, 2 };
+
+  for (unsigned int batch=begin; batch<end; batch+=n_lanes)
+    {
+      // Load the coordinates of the vertices of up to <code>n_lanes</code>
+      // cells. If the chunk does not contain a multiple of that many cells,
+      // we fill the remaining lanes with copies of the last cell and ignore
+      // them below:
+      VectorizedDouble x[4], y[4];
+      for (unsigned int lane=0; lane<n_lanes; ++lane)
+        {
+          const unsigned int cell = std::min (batch+lane, end-1);
+          for (unsigned int v=0; v<4; ++v)
+            {
+              const Point<2> &vertex = vertices[cell_vertices[4*cell+v]];
+              x[v][lane] = vertex[0];
+              y[v][lane] = vertex[1];
+            }
+        }
+
+      VectorizedDouble min_edge     = make_vectorized_array (std::numeric_limits<double>::max()),
+                       max_edge     = make_vectorized_array (0.),
+                       max_cosine   = make_vectorized_array (-1.),
+                       min_jacobian = make_vectorized_array (std::numeric_limits<double>::max());
+      for (unsigned int k=0; k<4; ++k)
+        {
+          const unsigned int p = corners[k],
+                             q = corners[(k+1)%4],
+                             r = corners[(k+3)%4];
+          const VectorizedDouble ax = x[q] - x[p],
+                                 ay = y[q] - y[p],
+                                 bx = x[r] - x[p],
+                                 by = y[r] - y[p];
+          const VectorizedDouble length_a = std::sqrt (ax*ax + ay*ay),
+                                 length_b = std::sqrt (bx*bx + by*by);
+
+          min_edge     = std::min (min_edge, length_a);
+          max_edge     = std::max (max_edge, length_a);
+          max_cosine   = std::max (max_cosine,
+                                   (ax*bx + ay*by) / (length_a*length_b));
+          min_jacobian = std::min (min_jacobian, ax*by - ay*bx);
+        }
+      const VectorizedDouble aspect_ratio = max_edge / min_edge;
+
+      for (unsigned int lane=0; lane<std::min (n_lanes, end-batch); ++lane)
+        statistics.add_cell (aspect_ratio[lane],
+                             std::acos (std::max (std::min (max_cosine[lane], 1.), -1.))
+                             * 180 / numbers::PI,
+                             min_jacobian[lane] > 0);
+    }
+}
+
+
+
+// As for the writers above, the statistics can be restricted to the cells
+// of one subdomain:
+MeshQualityStatistics
+compute_mesh_quality (const Triangulation<2>  &triangulation,
+                      const types::subdomain_id subdomain = numbers::invalid_subdomain_id)
+{
+  std::vector<unsigned int> cell_vertices;
+  cell_vertices.reserve (4 * triangulation.n_active_cells());
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (is_in_subdomain (cell, subdomain))
+      for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+        cell_vertices.push_back (cell->vertex_index(v));
+
+  const unsigned int n_cells    = cell_vertices.size() / 4;
+  const unsigned int chunk_size = 4096;
+  const unsigned int n_chunks   = (n_cells + chunk_size - 1) / chunk_size;
+
+  std::vector<MeshQualityStatistics> chunk_statistics (n_chunks);
+  Threads::TaskGroup<void> tasks;
+  for (unsigned int c=0; c<n_chunks; ++c)
+    tasks += Threads::new_task (std::function<void ()>
+                                (std::bind (&compute_quality_of_cells,
+                                            std::cref (triangulation.get_vertices()),
+                                            std::cref (cell_vertices),
+                                            c*chunk_size,
+                                            std::min ((c+1)*chunk_size, n_cells),
+                                            std::ref (chunk_statistics[c]))));
+  tasks.join_all ();
+
+  MeshQualityStatistics statistics;
+  for (unsigned int c=0; c<n_chunks; ++c)
+    statistics.merge (chunk_statistics[c]);
+  return statistics;
+}
+
+
+
+// @sect3{Partitioning the mesh}
+
+// Parallel solvers that use the meshes created here have to split them into
+// subdomains, one per processor. Rather than have every solver do this
+// anew, we can do it once, store the result in the <code>subdomain_id</code>
+// of each cell, and write it out along with the mesh.
+//
+// deal.II can partition a triangulation with METIS, if it was configured
+// with it, via GridTools::partition_triangulation(). As an alternative
+// that needs no external library, we provide a partitioning along a
+// space-filling curve: we sort the cells by the Morton ("z-order") index
+// of their centers, which keeps cells that are close in space close in
+// the sorted order, and cut the sorted list into pieces of equal size.
+// The following function computes the Morton index of a point with
+// coordinates in $[0,1]^2$ by interleaving the bits of the two integer
+// coordinates obtained by scaling them up to $[0,2^{32})$:
+std::uint64_t morton_index (const Point<2> &p)
+{
+  const auto spread_bits = [] (std::uint64_t x)
+  {
+    x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+    x = (x | (x << 8))  & 0x00FF00FF00FF00FFull;
+    x = (x | (x << 4))  & 0x0F0F0F0F0F0F0F0Full;
+    x = (x | (x << 2))  & 0x3333333333333333ull;
+    x = (x | (x << 1))  & 0x5555555555555555ull;
+    return x;
+  };
+
+  const double scale = 4294967295.;
+  return (spread_bits (static_cast<std::uint64_t>(std::min (std::max (p[0], 0.), 1.) * scale))
+          |
+          (spread_bits (static_cast<std::uint64_t>(std::min (std::max (p[1], 0.), 1.) * scale)) << 1));
+}
+
+
+
+void partition_triangulation_zorder (const unsigned int  n_partitions,
+                                     Triangulation<2>   &triangulation)
+{
+  // Find the bounding box of the mesh to scale cell centers into the unit
+  // square:
+  Point<2> lower (std::numeric_limits<double>::max(),
+                  std::numeric_limits<double>::max());
+  Point<2> upper (-std::numeric_limits<double>::max(),
+                  -std::numeric_limits<double>::max());
+  const std::vector<Point<2> > &vertices = triangulation.get_vertices();
+  for (unsigned int v=0; v<vertices.size(); ++v)
+    if (triangulation.get_used_vertices()[v])
+      for (unsigned int d=0; d<2; ++d)
+        {
+          lower[d] = std::min (lower[d], vertices[v][d]);
+          upper[d] = std::max (upper[d], vertices[v][d]);
+        }
+
+  std::vector<std::pair<std::uint64_t, Triangulation<2>::active_cell_iterator> >
+  sorted_cells;
+  sorted_cells.reserve (triangulation.n_active_cells());
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    {
+      Point<2> scaled_center;
+      for (unsigned int d=0; d<2; ++d)
+        scaled_center[d] = (cell->center()[d] - lower[d])
+                           / std::max (upper[d] - lower[d], 1e-300);
+      sorted_cells.push_back (std::make_pair (morton_index (scaled_center),
+                                              cell));
+    }
+  std::sort (sorted_cells.begin(), sorted_cells.end(),
+             [] (const std::pair<std::uint64_t, Triangulation<2>::active_cell_iterator> &a,
+                 const std::pair<std::uint64_t, Triangulation<2>::active_cell_iterator> &b)
+  {
+    return a.first < b.first;
+  });
+
+  for (unsigned int i=0; i<sorted_cells.size(); ++i)
+    sorted_cells[i].second->set_subdomain_id
+    (static_cast<std::uint64_t>(i) * n_partitions / sorted_cells.size());
+}
+
+
+
+// Whichever partitioner was used, we want to know how good the result is.
+// The two usual measures are the load balance, i.e., the ratio of the
+// largest number of cells in any subdomain to the average, and the edge
+// cut, i.e., the number of faces between cells of different subdomains
+// (which is proportional to the amount of communication a solver has to
+// do). When counting faces, we have to be careful not to count a face
+// twice and to count each child of a face that has hanging nodes: we only
+// count a face from the side of the finer cell, and from the cell with the
+// smaller index if both are on the same level.
+struct PartitionStatistics
+{
+  std::vector<unsigned int> n_cells_per_subdomain;
+  unsigned int              n_cut_faces;
+  unsigned int              n_interior_faces;
+
+  double load_imbalance () const
+  {
+    const double average
+      = std::accumulate (n_cells_per_subdomain.begin(),
+                         n_cells_per_subdomain.end(), 0.)
+        / n_cells_per_subdomain.size();
+    return *std::max_element (n_cells_per_subdomain.begin(),
+                              n_cells_per_subdomain.end())
+           / average;
+  }
+};
+
+
+
+PartitionStatistics
+compute_partition_statistics (const Triangulation<2> &triangulation,
+                              const unsigned int      n_partitions)
+{
+  PartitionStatistics statistics;
+  statistics.n_cells_per_subdomain.resize (n_partitions, 0);
+  statistics.n_cut_faces      = 0;
+  statistics.n_interior_faces = 0;
+
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    {
+      ++statistics.n_cells_per_subdomain[cell->subdomain_id()];
+
+      for (unsigned int f=0; f<GeometryInfo<2>::faces_per_cell; ++f)
+        if (!cell->at_boundary(f))
+          {
+            const Triangulation<2>::cell_iterator neighbor = cell->neighbor(f);
+            if (neighbor->has_children())
+              continue;
+            if (!cell->neighbor_is_coarser(f)
+                && (neighbor->index() < cell->index()))
+              continue;
+
+            ++statistics.n_interior_faces;
+            if (neighbor->subdomain_id() != cell->subdomain_id())
+              ++statistics.n_cut_faces;
+          }
+    }
+
+  return statistics;
+}
+
+
+
+// The function called from second_grid() partitions the mesh with the
+// requested method and reports the statistics:
+void partition_mesh (Triangulation<2>     &triangulation,
+                     const ProgramOptions &options)
+{
+  TraceScope trace_scope ("partition");
+  Timer timer;
+  switch (options.partitioner)
+    {
+    case Partitioner::zorder:
+      partition_triangulation_zorder (options.n_subdomains, triangulation);
+      break;
+
+    case Partitioner::metis:
+#ifdef DEAL_II_WITH_METIS
+      GridTools::partition_triangulation (options.n_subdomains,
+                                          triangulation);
+#else
+      AssertThrow (false,
+                   ExcMessage ("Partitioning with METIS requires deal.II "
+                               "to be configured with METIS."));
+#endif
+      break;
+
+    default:
+      Assert (false, ExcNotImplemented());
+    }
+  timer.stop ();
+
+  const PartitionStatistics statistics
+    = compute_partition_statistics (triangulation, options.n_subdomains);
+  std::cout << "Partitioned mesh into " << options.n_subdomains
+            << " subdomains in " << timer.wall_time() << " s:" << std::endl
+            << "    cells per subdomain:";
+  for (unsigned int i=0; i<options.n_subdomains; ++i)
+    std::cout << ' ' << statistics.n_cells_per_subdomain[i];
+  std::cout << std::endl
+            << "    load imbalance (max/average): "
+            << statistics.load_imbalance() << std::endl
+            << "    edge cut: " << statistics.n_cut_faces << " of "
+            << statistics.n_interior_faces << " interior faces" << std::endl;
+}
+
+
+
+// @sect3{Streaming telemetry}
+
+// Refining a large mesh many times can take hours, and it is useful to see
+// how far the program has come and where it spends its time without having
+// to wait for it to finish. If asked for, second_grid() therefore writes a
+// record of every refinement step to a file, one JSON object per line, so
+// that other programs can follow the file (for example with
+// <code>tail -f</code>) and plot the progress as it happens. The file can
+// also be a named pipe (see <code>man mkfifo</code>) read by such a
+// program.
+//
+// Writing to a file can block: the disk may be slow, and a named pipe
+// blocks until somebody reads from it. The refinement must not wait for
+// any of this, so the TelemetryStream class below works like the
+// compressing stream buffer above: write() only puts the line into a
+// queue, and a separate thread takes lines out of the queue and writes
+// them to the file. Unlike there, we do not wait if the queue is full
+// but drop the line and count how many were lost; a dashboard can live
+// with a gap, while an hours-long computation should not stand still
+// because nobody reads the pipe. For the same reason, the file is opened
+// without blocking, and if there is no reader yet, the writer thread tries
+// again until one appears.
+class TelemetryStream
+{
+public:
+  TelemetryStream (const std::string &filename);
+  ~TelemetryStream ();
+
+  void write (const std::string &line);
+
+private:
+  void write_queued_lines ();
+  bool open_file ();
+
+  static const unsigned int max_queued_lines = 1024;
+
+  const std::string        filename;
+  int                      file_descriptor;
+  unsigned int             n_dropped_lines;
+
+  std::deque<std::string>  queue;
+  bool                     all_lines_queued;
+  std::mutex               queue_mutex;
+  std::condition_variable  queue_changed;
+  std::thread              worker;
+};
+
+
+
+// If the program reading a named pipe goes away while we still write to
+// it, the operating system sends the SIGPIPE signal, which by default
+// terminates the program. We ignore the signal, and the write simply
+// fails instead.
+//
+// The first attempt to open the file is made here rather than on the
+// writer thread: an exception thrown on a std::thread cannot be caught by
+// anyone and terminates the program, whereas here a wrong file name is
+// reported like any other error. The only failure we accept is the one of
+// a named pipe without a reader, see open_file():
+TelemetryStream::TelemetryStream (const std::string &filename)
+  :
+  filename (filename),
+  file_descriptor (-1),
+  n_dropped_lines (0),
+  all_lines_queued (false)
+{
+  std::signal (SIGPIPE, SIG_IGN);
+  if (!open_file ())
+    AssertThrow (errno == ENXIO,
+                 ExcMessage ("Could not open telemetry file <"
+                             + filename + ">: " + std::strerror (errno)));
+  worker = std::thread (&TelemetryStream::write_queued_lines, this);
+}
+
+
+
+TelemetryStream::~TelemetryStream ()
+{
+  {
+    std::lock_guard<std::mutex> lock (queue_mutex);
+    all_lines_queued = true;
+  }
+  queue_changed.notify_all ();
+  worker.join ();
+
+  if (n_dropped_lines > 0)
+    std::cout << "  Telemetry: " << n_dropped_lines << " records could not "
+              << "be written to " << filename << std::endl;
+}
+
+
+
+void TelemetryStream::write (const std::string &line)
+{
+  {
+    std::lock_guard<std::mutex> lock (queue_mutex);
+    if (queue.size() >= max_queued_lines)
+      {
+        ++n_dropped_lines;
+        return;
+      }
+    queue.push_back (line + '\n');
+  }
+  queue_changed.notify_all ();
+}
+
+
+
+// Opening a named pipe for writing with O_NONBLOCK fails (with ENXIO)
+// as long as nobody has opened it for reading; for regular files, it
+// succeeds right away. Once the file is open, we switch back to blocking
+// writes since only the writer thread waits for them. On failure, errno
+// tells why:
+bool TelemetryStream::open_file ()
+{
+  file_descriptor = open (filename.c_str(),
+                          O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+  if (file_descriptor < 0)
+    return false;
+
+  fcntl (file_descriptor, F_SETFL,
+         fcntl (file_descriptor, F_GETFL) & ~O_NONBLOCK);
+  return true;
+}
+
+
+
+// The function running on the writer thread. While the file cannot be
+// opened yet, it tries again every 100 milliseconds, whether or not lines
+// are waiting in the queue (waiting for new lines instead would return
+// right away once there are some, and the thread would spin); lines that
+// are still queued when the program ends without anybody having opened the
+// pipe are counted as dropped. Once the file is open, the thread sleeps
+// until there is something to write:
+void TelemetryStream::write_queued_lines ()
+{
+  trace_recorder.name_this_thread ("telemetry");
+  while (true)
+    {
+      std::string line;
+      {
+        std::unique_lock<std::mutex> lock (queue_mutex);
+        if ((file_descriptor < 0) && !open_file ())
+          {
+            if (all_lines_queued)
+              {
+                n_dropped_lines += queue.size();
+                queue.clear ();
+                break;
+              }
+            queue_changed.wait_for (lock, std::chrono::milliseconds(100),
+                                    [this] ()
+            {
+              return all_lines_queued;
+            });
+            continue;
+          }
+
+        queue_changed.wait (lock, [this] ()
+        {
+          return (!queue.empty() || all_lines_queued);
+        });
+        if (queue.empty())
+          break;
+
+        line.swap (queue.front());
+        queue.pop_front ();
+      }
+
+      TraceScope trace_scope ("write telemetry");
+      std::size_t n_written = 0;
+      while (n_written < line.size())
+        {
+          const ssize_t n = ::write (file_descriptor,
+                                     line.data() + n_written,
+                                     line.size() - n_written);
+          if (n < 0)
+            {
+              if (errno == EINTR)
+                continue;
+              std::lock_guard<std::mutex> lock (queue_mutex);
+              ++n_dropped_lines;
+              break;
+            }
+          n_written += n;
+        }
+    }
+
+  if (file_descriptor >= 0)
+    close (file_descriptor);
+}
+
+
+
+// What we record for each refinement step: the step number, the number of
+// active cells on each level, how many cells are flagged for refinement
+// and coarsening once prepare_coarsening_and_refinement() has added the
+// flags the triangulation needs (that is, what the refinement will
+// actually do), how many vertices the refinement created, the wall time
+// of each stage of the step in the order in which they ran, and the
+// memory of the process. A step in which the memory guard stopped the
+// refinement is recorded, too, so that whoever follows the file learns
+// why the records end there; the guard has cleared all flags of such a
+// step, and its record has zero flagged cells and no new vertices. The
+// to_json() function produces the line that is written to the stream; we
+// write it by hand since the format is simple and we do not want to depend
+// on a JSON library for it.
+struct RefinementStepRecord
+{
+  unsigned int                                   step;
+  bool                                           stopped_by_memory_budget;
+  std::vector<unsigned int>                      n_active_cells_per_level;
+  unsigned int                                   n_cells_flagged_for_refinement;
+  unsigned int                                   n_cells_flagged_for_coarsening;
+  unsigned int                                   n_new_vertices;
+  std::vector<std::pair<std::string,double> >    stage_times;
+  double                                         elapsed_time;
+
+  std::string to_json () const;
+};
+
+
+
+std::string RefinementStepRecord::to_json () const
+{
+  Utilities::System::MemoryStats memory_stats;
+  Utilities::System::get_memory_stats (memory_stats);
+
+  std::ostringstream json;
+  json << std::setprecision (6)
+       << "{\"step\":" << step << ",\"n_active_cells\":"
+       << std::accumulate (n_active_cells_per_level.begin(),
+                           n_active_cells_per_level.end(), 0u)
+       << ",\"n_active_cells_per_level\":[";
+  for (unsigned int level=0; level<n_active_cells_per_level.size(); ++level)
+    json << (level > 0 ? "," : "") << n_active_cells_per_level[level];
+  json << "],\"n_flagged_for_refinement\":" << n_cells_flagged_for_refinement
+       << ",\"n_flagged_for_coarsening\":" << n_cells_flagged_for_coarsening
+       << ",\"n_new_vertices\":" << n_new_vertices
+       << ",\"stopped_by_memory_budget\":"
+       << (stopped_by_memory_budget ? "true" : "false")
+       << ",\"stage_times\":{";
+  for (unsigned int i=0; i<stage_times.size(); ++i)
+    json << (i > 0 ? "," : "") << '"' << stage_times[i].first << "\":"
+         << stage_times[i].second;
+  json << "},\"elapsed_time\":" << elapsed_time
+       << ",\"memory_rss_mb\":" << memory_stats.VmRSS / 1024.
+       << ",\"memory_peak_mb\":" << memory_stats.VmHWM / 1024.
+       << '}';
+  return json.str();
+}
+
+
+
+// @sect3{Creating the second mesh}
+
+// The grid in the following, second function is slightly more complicated in
+// that we use a ring domain and refine the result once globally.
+void second_grid (const ProgramOptions &options)
+{
+  TraceScope trace_scope ("second grid");
+
+  // We start again by defining an object for a triangulation of a
+  // two-dimensional domain:
+  Triangulation<2> triangulation;
+
+  // We then fill it with a ring domain. The center of the ring shall be the
+  // point (1,0), and inner and outer radius shall be 0.5 and 1. The number of
+  // circumferential cells could be adjusted automatically by this function,
+  // but we choose to set it explicitly to 10 as the last argument (unless a
+  // different number was given on the command line):
+  //
+  // Alternatively, the coarse mesh can be read from a file given on the
+  // command line, using the import_mesh() function above. The marking and
+  // refinement below then work on that mesh instead, still towards the
+  // circle around <code>center</code> with radius <code>inner_radius</code>.
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+  if (!options.input_mesh_file.empty())
+    import_mesh (options.input_mesh_file, triangulation);
+  else
+    create_ring (triangulation,
+                 center, inner_radius, outer_radius,
+                 options.n_circumferential_cells);
+  // By default, the triangulation assumes that all boundaries are
+  // straight lines, and all cells are bi-linear quads or tri-linear
+  // hexes, and that they are defined by the cells of the coarse grid
+  // (which we just created). Unless we do something special, when new
+  // points need to be introduced; the domain is assumed to be
+  // delineated by the straight lines of the coarse mesh, and new
+  // points will simply be in the middle of the surrounding ones.
+  // Here, however, we know that the domain is curved, and we would
+  // like to have the Triangulation place new points according to the
+  // underlying geometry. Fortunately, some good soul implemented an
+  // object which describes a spherical domain, of which the ring is a
+  // section; it only needs the center of the ring and automatically
+  // figures out how to instruct the Triangulation where to place the
+  // new points. The way this works in deal.II is that you tag parts
+  // of the triangulation you want to be curved with a number that is
+  // usually referred to as "manifold indicator" and then tell the
+  // triangulation to use a particular "manifold object" for all
+  // places with this manifold indicator. How exactly this works is
+  // not important at this point (you can read up on it in step-53 and
+  // @ref manifold). Here, for simplicity, we will choose the manifold
+  // id to be zero.  By default, all cells and faces of the
+  // Triangulation have their manifold_id set to
+  // numbers::invalid_manifold_id, which is the default if you want a
+  // manifold that produces straight edges, but you can change this
+  // number for individual cells and faces. In that case, the curved
+  // manifold thus associated with number zero will not apply to those
+  // parts with a non-zero manifold indicator, but other manifold
+  // description objects can be associated with those non-zero
+  // indicators. If no manifold description is associated with a
+  // particular manifold indicator, a manifold that produces straight
+  // edges is implied. (Manifold indicators are a slightly complicated
+  // topic; if you're confused about what exactly is happening here,
+  // you may want to look at the @ref GlossManifoldIndicator "glossary
+  // entry on this topic".)
+  //
+  // We do not know anything about the geometry of an imported mesh, so we
+  // only attach the manifold to meshes we generated ourselves:
+  if (options.input_mesh_file.empty())
+    triangulation.set_all_manifold_ids(0);
+  const SphericalManifold<2> manifold_description(center);
+  triangulation.set_manifold (0, manifold_description);
+
+  // In order to demonstrate how to write a loop over all cells, we will
+  // refine the grid in five steps (unless a different number was given on
+  // the command line) towards the inner circle of the domain. How the cells
+  // to be refined are chosen in each step is the business of the
+  // RefinementMarker class above.
+  //
+  // If a telemetry file was given on the command line, we also time the
+  // stages of each step and send a record of it to a TelemetryStream; see
+  // there.
+  RefinementMarker refinement_marker (triangulation, center, inner_radius,
+                                      options);
+  std::unique_ptr<TelemetryStream> telemetry;
+  if (!options.telemetry_file.empty())
+    telemetry.reset (new TelemetryStream (options.telemetry_file));
+  Timer total_timer;
+  for (unsigned int step=0; step<options.n_refinement_steps; ++step)
+    {
+      RefinementStepRecord record;
+      record.step                     = step;
+      record.stopped_by_memory_budget = false;
+      record.n_new_vertices           = 0;
+      Timer stage_timer;
+
+      const auto send_record = [&] ()
+      {
+        for (unsigned int level=0; level<triangulation.n_levels(); ++level)
+          record.n_active_cells_per_level
+          .push_back (triangulation.n_active_cells (level));
+        record.elapsed_time = total_timer.wall_time();
+        telemetry->write (record.to_json());
+      };
+
+      {
+        TraceScope trace_scope ("mark cells");
+        refinement_marker.mark_cells ();
+      }
+      record.stage_times.emplace_back ("mark", stage_timer.wall_time());
+      stage_timer.restart ();
+
+      // Before refining, we check that the refinement will not exceed the
+      // memory budget; check_refinement_memory() may also have removed
+      // some of the flags, or tell us to stop altogether (after the
+      // telemetry has been told so):
+      bool refinement_fits_budget;
+      {
+        TraceScope trace_scope ("memory check");
+        refinement_fits_budget = check_refinement_memory (triangulation,
+                                                          options);
+      }
+      record.stage_times.emplace_back ("memory_check", stage_timer.wall_time());
+
+      record.n_cells_flagged_for_refinement = 0;
+      record.n_cells_flagged_for_coarsening = 0;
+      if (!refinement_fits_budget)
+        {
+          if (telemetry)
+            {
+              record.stopped_by_memory_budget = true;
+              send_record ();
+            }
+          break;
+        }
+
+      // check_refinement_memory() only computes a forecast, and with it
+      // calls prepare_coarsening_and_refinement(), if a budget or a
+      // forecast was requested. To count the flags that the refinement
+      // will act upon in any case, we call the function here ourselves; it
+      // does nothing if the flags are already consistent, and
+      // execute_coarsening_and_refinement() below calls it again anyway:
+      if (telemetry)
+        {
+          triangulation.prepare_coarsening_and_refinement ();
+          for (Triangulation<2>::active_cell_iterator
+               cell = triangulation.begin_active();
+               cell != triangulation.end(); ++cell)
+            if (cell->refine_flag_set())
+              ++record.n_cells_flagged_for_refinement;
+            else if (cell->coarsen_flag_set())
+              ++record.n_cells_flagged_for_coarsening;
+        }
+
+      const unsigned int n_vertices_before = triangulation.n_used_vertices();
+      stage_timer.restart ();
+
+      // Now that we have marked all the cells that we want refined, we let
+      // the triangulation actually do this refinement. The function that does
+      // so owes its long name to the fact that one can also mark cells for
+      // coarsening, and the function does coarsening and refinement all at
+      // once:
+      {
+        TraceScope trace_scope ("refine");
+        triangulation.execute_coarsening_and_refinement ();
+      }
+      record.stage_times.emplace_back ("refine", stage_timer.wall_time());
+      record.n_new_vertices = triangulation.n_used_vertices() - n_vertices_before;
+
+      if (options.refinement_strategy != RefinementStrategy::inner_boundary)
+        std::cout << "  Refinement step " << step << ": "
+                  << triangulation.n_active_cells() << " active cells"
+                  << std::endl;
+
+      // If requested, we check after every step that the new vertices
+      // placed by the manifold have not distorted the cells:
+      if (options.report_mesh_quality)
+        {
+          TraceScope trace_scope ("mesh quality");
+          Timer timer;
+          const MeshQualityStatistics statistics
+            = compute_mesh_quality (triangulation);
+          record.stage_times.emplace_back ("quality", timer.wall_time());
+          std::cout << "  Mesh quality after refinement step " << step
+                    << " (computed in " << timer.wall_time() << " s):"
+                    << std::endl;
+          statistics.print (std::cout);
+        }
+
+      if (telemetry)
+        send_record ();
+    }
+
+
+  // If asked for, we partition the mesh into subdomains for parallel
+  // solvers before writing it, so that the subdomain ids end up in the
+  // output files that can store them. The EPS format has no way to show the
+  // partition, so we also write it out in SVG format with cells colored by
+  // subdomain:
+  if (options.n_subdomains > 0)
+    {
+      partition_mesh (triangulation, options);
+
+      const std::string partition_filename
+        = "grid-2-partition.svg" + options.output_suffix;
+      {
+        const std::unique_ptr<std::ostream> out
+          = open_output_file (partition_filename);
+        GridOutFlags::Svg svg_flags;
+        svg_flags.coloring = GridOutFlags::Svg::subdomain_id;
+        GridOut grid_out;
+        grid_out.set_flags (svg_flags);
+        grid_out.write_svg (triangulation, *out);
+        close_output_file (*out);
+      }
+      std::cout << "Partition written to " << partition_filename << std::endl;
+    }
+
+  // Finally, after these iterations of refinement, we want to again
+  // write the resulting mesh to a file, again in eps format unless other
+  // formats were requested. This works just as above:
+  write_grid (triangulation, "grid-2", options);
+
+  // The files above show the curved cells at the ring's boundaries as
+  // polygons with straight edges. If requested, we also write the mesh
+  // with its edges curved as described by a higher order mapping:
+  if (options.write_curved_output)
+    write_curved_grid (triangulation, "grid-2", options);
+
+  // At this point, all objects created in this function will be destroyed in
+  // reverse order. Unfortunately, we defined the manifold object after the
+  // triangulation, which still has a pointer to it and the library will
+  // produce an error if the manifold object is destroyed before the
+  // triangulation. We therefore have to release it, which can be done as
+  // follows. Note that this sets the manifold object used for part "0" of the
+  // domain back to a default object, over which the triangulation has full
+  // control.
+  triangulation.set_manifold (0);
+  // An alternative to doing so, and one that is frequently more convenient,
+  // would have been to declare the manifold object before the triangulation
+  // object. In that case, the triangulation would have let lose of the
+  // manifold object upon its destruction, and everything would have been
+  // fine.
+}
+
+
+
+// @sect3{Running on several processes}
+
+// The functions so far run on a single process, on which the mesh has to
+// fit. deal.II has two triangulation classes for programs that run on
+// several processes with MPI, and second_grid() can use either of them,
+// selected with <code>--parallel=shared</code> or
+// <code>--parallel=distributed</code>:
+// - parallel::shared::Triangulation stores the whole mesh on every
+//   process, but assigns each active cell to one of them by its
+//   <code>subdomain_id</code>; each process only works on its "locally
+//   owned" cells. This needs nothing but MPI.
+// - parallel::distributed::Triangulation only stores the locally owned
+//   cells of each process and a layer of "ghost" cells around them, and
+//   leaves keeping track of who owns what to the p4est library. This needs
+//   deal.II to be configured with p4est.
+//
+// In both cases, each process marks only its own cells. The distributed
+// triangulation takes care of making the refinement consistent across
+// processes itself, but every copy of a shared triangulation has to be
+// given exactly the same flags, since each copy refines the whole mesh. The
+// processes therefore exchange their flags: each one puts its flags into
+// an array with one byte per active cell (the active cells are in the same
+// order on all processes), and a bitwise "or" over all processes gives
+// everyone all flags. For a serial or a distributed triangulation, there
+// is nothing to exchange.
+//
+// Running one process per core is not always the best use of a machine:
+// every process of a shared triangulation stores the whole mesh, and every
+// process of a distributed one the coarse mesh and its ghost cells, so
+// memory use grows with the number of processes. Each process therefore
+// runs its share of the work on as many threads as it is given (see the
+// <code>--threads-per-process</code> option), using the same
+// functions as second_grid() restricted to its own subdomain: marking with
+// mark_cells_where_in_parallel(), the quality check with
+// compute_mesh_quality(), and writing with write_ucd(), which formats the
+// output on several threads. For a serial triangulation,
+// locally_owned_subdomain() returns numbers::invalid_subdomain_id, and
+// all of these functions then work on all cells.
+void mark_locally_owned_inner_boundary_cells (Triangulation<2> &triangulation,
+                                              const Point<2>   &center,
+                                              const double      inner_radius)
+{
+  mark_cells_where_in_parallel (triangulation,
+                                NearCircle (center, inner_radius),
+                                triangulation.locally_owned_subdomain());
+}
+
+
+
+void exchange_refine_flags (Triangulation<2> &)
+{}
+
+
+
+#ifdef DEAL_II_WITH_MPI
+void exchange_refine_flags (parallel::shared::Triangulation<2> &triangulation)
+{
+  std::vector<unsigned char> flags (triangulation.n_active_cells(), 0);
+  unsigned int index = 0;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell, ++index)
+    flags[index] = cell->refine_flag_set();
+
+  MPI_Allreduce (MPI_IN_PLACE, flags.data(), flags.size(),
+                 MPI_UNSIGNED_CHAR, MPI_BOR, triangulation.get_communicator());
+
+  index = 0;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell, ++index)
+    if (flags[index] && !cell->refine_flag_set())
+      cell->set_refine_flag ();
+}
+#endif
+
+
+
+// A run on many processes can fail after hours, and should then not have
+// to start from the beginning again. For a distributed triangulation, this
+// program can therefore write checkpoints every few refinement steps, and
+// restart from one of them. The triangulation class does most of the
+// work: parallel::distributed::Triangulation::save() writes the refinement
+// of the forest of all processes into one file, together with data the
+// program has attached to each cell, and load() reads it back. A
+// checkpoint does not store how the cells were distributed among the
+// processes, so a run can be restarted on a different number of processes
+// than the one that wrote the checkpoint; load() then simply distributes
+// the cells anew.
+//
+// The data we attach is, for each cell, the refinement step that created
+// it, which we keep in the cell's user index. This is data that could not
+// be recomputed from the mesh after a restart, and it has to survive
+// refinement as well: when the triangulation moves cells from one process
+// to another, only the mesh moves with them, and everything else the
+// program has stored for a cell is lost. The same mechanism is therefore
+// used in each refinement step: before it, we register a function that
+// packs the data of each cell into a buffer; after it, the triangulation
+// hands the buffer of each cell to a function that unpacks it on the
+// process that now owns the cell. For a cell that was refined, we are
+// given the buffer of its parent, and give each child the number of the
+// current step.
+//
+// For all other kinds of triangulation, the following three functions do
+// nothing beyond refining the mesh, and there is no checkpoint to restart
+// from:
+template <class TriangulationType>
+void refine_and_transfer_cell_data (TriangulationType  &triangulation,
+                                    const unsigned int)
+{
+  triangulation.execute_coarsening_and_refinement ();
+}
+
+
+
+template <class TriangulationType>
+void write_checkpoint (TriangulationType  &,
+                       const unsigned int)
+{}
+
+
+
+template <class TriangulationType>
+unsigned int restart_from_checkpoint (TriangulationType &,
+                                      const std::string &)
+{
+  return 0;
+}
+
+
+
+#ifdef DEAL_II_WITH_P4EST
+void pack_creation_step (const Triangulation<2>::cell_iterator &cell,
+                         const Triangulation<2>::CellStatus,
+                         void                                  *data)
+{
+  const unsigned int creation_step = cell->user_index();
+  std::memcpy (data, &creation_step, sizeof(creation_step));
+}
+
+
+
+void refine_and_transfer_cell_data (parallel::distributed::Triangulation<2> &triangulation,
+                                    const unsigned int                       step)
+{
+  const unsigned int offset
+    = triangulation.register_data_attach (sizeof(unsigned int),
+                                          &pack_creation_step);
+
+  triangulation.execute_coarsening_and_refinement ();
+
+  triangulation.notify_ready_to_unpack
+  (offset,
+   [step] (const Triangulation<2>::cell_iterator &cell,
+           const Triangulation<2>::CellStatus     status,
+           const void                            *data)
+  {
+    unsigned int creation_step;
+    std::memcpy (&creation_step, data, sizeof(creation_step));
+
+    if (status == Triangulation<2>::CELL_REFINE)
+      for (unsigned int c=0; c<cell->n_children(); ++c)
+        cell->child(c)->set_user_index (step+1);
+    else
+      cell->set_user_index (creation_step);
+  });
+}
+
+
+
+// A checkpoint consists of the files that save() writes, plus a small file
+// of our own that records after how many refinement steps it was written,
+// where in the data of each cell our data starts, how many processes
+// wrote it, and how many cells the coarse mesh had. All processes write
+// the mesh file together; to know how fast this is, we measure the time
+// the slowest process takes and divide the size of the files by it.
+std::string checkpoint_name (const unsigned int step)
+{
+  return "checkpoint-" + Utilities::int_to_string (step, 4);
+}
+
+
+
+double file_size_in_mb (const std::string &file_name)
+{
+  struct stat status;
+  if (stat (file_name.c_str(), &status) != 0)
+    return 0;
+  return status.st_size / 1024. / 1024.;
+}
+
+
+
+// The triangulation is not changed by save() in any way visible to us, but
+// registering data to be saved with it requires a non-const object:
+void write_checkpoint (parallel::distributed::Triangulation<2> &triangulation,
+                       const unsigned int                       n_steps_done)
+{
+  TraceScope trace_scope ("write checkpoint");
+
+  const MPI_Comm communicator = triangulation.get_communicator();
+  const std::string name = checkpoint_name (n_steps_done);
+
+  MPI_Barrier (communicator);
+  Timer timer;
+  const unsigned int offset
+    = triangulation.register_data_attach (sizeof(unsigned int),
+                                          &pack_creation_step);
+  triangulation.save (name);
+  const double time = Utilities::MPI::max (timer.wall_time(), communicator);
+
+  if (Utilities::MPI::this_mpi_process (communicator) == 0)
+    {
+      std::ofstream run_info ((name + ".run").c_str());
+      run_info << n_steps_done << ' ' << offset << ' '
+               << Utilities::MPI::n_mpi_processes (communicator) << ' '
+               << triangulation.n_cells (0) << std::endl;
+      AssertThrow (run_info, ExcMessage ("Could not write file <"
+                                         + name + ".run>."));
+
+      const double size = file_size_in_mb (name) + file_size_in_mb (name + ".info");
+      std::cout << "Wrote checkpoint <" << name << "> after step "
+                << n_steps_done << ": " << size << " MB in " << time
+                << " s (" << size / time << " MB/s)" << std::endl;
+    }
+}
+
+
+
+// Restarting from a checkpoint requires the same coarse mesh as the run
+// that wrote it, which the caller has already created. p4est cannot tell
+// whether it is, so we compare at least the number of coarse cells (which
+// differs if the restart uses a different
+// <code>--circumferential-cells</code>). We then read the refinement and
+// the data attached to each cell, and return the number of refinement
+// steps the checkpoint was written after, so that the caller can continue
+// with the next one:
+unsigned int restart_from_checkpoint (parallel::distributed::Triangulation<2> &triangulation,
+                                      const std::string                       &name)
+{
+  if (name.empty())
+    return 0;
+
+  TraceScope trace_scope ("restart from checkpoint");
+  const MPI_Comm communicator = triangulation.get_communicator();
+
+  unsigned int n_steps_done, offset, n_writing_processes, n_coarse_cells;
+  {
+    std::ifstream run_info ((name + ".run").c_str());
+    AssertThrow (run_info, ExcMessage ("Could not open checkpoint file <"
+                                       + name + ".run>."));
+    run_info >> n_steps_done >> offset >> n_writing_processes
+             >> n_coarse_cells;
+    AssertThrow (run_info,
+                 ExcMessage ("The file <" + name + ".run> is not a "
+                             "checkpoint written by this program."));
+  }
+  AssertThrow (n_coarse_cells == triangulation.n_cells (0),
+               ExcMessage ("The checkpoint <" + name + "> was written for a "
+                           "coarse mesh with "
+                           + Utilities::int_to_string (n_coarse_cells)
+                           + " cells, but the coarse mesh has "
+                           + Utilities::int_to_string (triangulation.n_cells (0))
+                           + " cells."));
+
+  MPI_Barrier (communicator);
+  Timer timer;
+  triangulation.load (name);
+  triangulation.notify_ready_to_unpack
+  (offset,
+   [] (const Triangulation<2>::cell_iterator &cell,
+       const Triangulation<2>::CellStatus,
+       const void                            *data)
+  {
+    unsigned int creation_step;
+    std::memcpy (&creation_step, data, sizeof(creation_step));
+    cell->set_user_index (creation_step);
+  });
+  const double time = Utilities::MPI::max (timer.wall_time(), communicator);
+
+  if (Utilities::MPI::this_mpi_process (communicator) == 0)
+    {
+      const double size = file_size_in_mb (name) + file_size_in_mb (name + ".info");
+      std::cout << "Restarted from checkpoint <" << name << "> written after step "
+                << n_steps_done << " by " << n_writing_processes
+                << " process(es), on "
+                << Utilities::MPI::n_mpi_processes (communicator)
+                << " process(es): " << triangulation.n_global_active_cells()
+                << " cells, " << size << " MB in " << time << " s ("
+                << size / time << " MB/s)" << std::endl;
+    }
+
+  return n_steps_done;
+}
+#endif
+
+
+
+// The following function then does what second_grid() does, on whichever
+// kind of triangulation it is given, and measures how long each part takes
+// on this process. It checks the quality of the locally owned cells of the
+// final mesh and, if given a file name, writes them to a UCD file of its
+// own whose name ends in the number of the process. The memory we report
+// is the memory the triangulation uses on this process, as reported by
+// Triangulation::memory_consumption() (which, for the distributed
+// triangulation, includes the p4est data). We do not report the memory of
+// the process: it depends on what the process did before, since memory
+// that an earlier triangulation released is reused by later ones, and
+// would not compare the triangulations with each other.
+struct ParallelRunStatistics
+{
+  double       setup_time;
+  double       marking_time;
+  double       exchange_time;
+  double       refinement_time;
+  double       quality_time;
+  double       output_time;
+  double       triangulation_memory;
+  unsigned int n_locally_owned_cells;
+
+  MeshQualityStatistics quality;
+};
+
+
+
+template <class TriangulationType>
+ParallelRunStatistics
+refine_ring_in_parallel (TriangulationType    &triangulation,
+                         const ProgramOptions &options,
+                         const std::string    &output_name)
+{
+  ParallelRunStatistics statistics;
+
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+  const SphericalManifold<2> manifold_description(center);
+
+  Timer timer;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  const unsigned int first_step
+    = restart_from_checkpoint (triangulation, options.restart_file);
+  statistics.setup_time = timer.wall_time();
+
+  statistics.marking_time    = 0;
+  statistics.exchange_time   = 0;
+  statistics.refinement_time = 0;
+  for (unsigned int step=first_step; step<options.n_refinement_steps; ++step)
+    {
+      timer.restart ();
+      mark_locally_owned_inner_boundary_cells (triangulation, center,
+                                               inner_radius);
+      statistics.marking_time += timer.wall_time();
+
+      timer.restart ();
+      exchange_refine_flags (triangulation);
+      statistics.exchange_time += timer.wall_time();
+
+      timer.restart ();
+      refine_and_transfer_cell_data (triangulation, step);
+      statistics.refinement_time += timer.wall_time();
+
+      if ((options.checkpoint_interval > 0)
+          &&
+          ((step+1) % options.checkpoint_interval == 0))
+        write_checkpoint (triangulation, step+1);
+    }
+
+  const types::subdomain_id subdomain = triangulation.locally_owned_subdomain();
+
+  timer.restart ();
+  statistics.quality = compute_mesh_quality (triangulation, subdomain);
+  statistics.quality_time = timer.wall_time();
+
+  timer.restart ();
+  if (!output_name.empty())
+    {
+      const unsigned int process
+        = (subdomain == numbers::invalid_subdomain_id ? 0 : subdomain);
+      const std::unique_ptr<std::ostream> out
+        = open_output_file (output_name + "." + Utilities::int_to_string (process, 4)
+                            + ".inp" + options.output_suffix);
+      write_ucd (triangulation, *out, subdomain);
+      close_output_file (*out);
+    }
+  statistics.output_time = timer.wall_time();
+
+  statistics.n_locally_owned_cells = 0;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (cell->is_locally_owned())
+      ++statistics.n_locally_owned_cells;
+
+  statistics.triangulation_memory = triangulation.memory_consumption() / 1024. / 1024.;
+
+  triangulation.set_manifold (0);
+  return statistics;
+}
+
+
+
+// The statistics are printed by the first process, with the times being
+// the largest over all processes (since the slowest process determines
+// how long the whole run takes), the memory summed over all processes, and
+// the number of cells given by the smallest and largest number that any
+// process owns. The quality statistics of the processes are combined the
+// same way MeshQualityStatistics::merge() combines those of several
+// chunks of cells:
+MeshQualityStatistics
+merge_over_processes (const MeshQualityStatistics &local_statistics,
+                      const MPI_Comm               communicator)
+{
+  MeshQualityStatistics statistics;
+  statistics.n_cells          = Utilities::MPI::sum (local_statistics.n_cells,
+                                                     communicator);
+  statistics.min_aspect_ratio = Utilities::MPI::min (local_statistics.min_aspect_ratio,
+                                                     communicator);
+  statistics.max_aspect_ratio = Utilities::MPI::max (local_statistics.max_aspect_ratio,
+                                                     communicator);
+  statistics.min_angle        = Utilities::MPI::min (local_statistics.min_angle,
+                                                     communicator);
+  statistics.n_inverted_cells = Utilities::MPI::sum (local_statistics.n_inverted_cells,
+                                                     communicator);
+  for (unsigned int b=0; b<MeshQualityStatistics::n_bins; ++b)
+    {
+      statistics.aspect_ratio_histogram[b]
+        = Utilities::MPI::sum (local_statistics.aspect_ratio_histogram[b],
+                               communicator);
+      statistics.min_angle_histogram[b]
+        = Utilities::MPI::sum (local_statistics.min_angle_histogram[b],
+                               communicator);
+    }
+  return statistics;
+}
+
+
+
+void print_parallel_statistics (const std::string           &name,
+                                const ParallelRunStatistics &statistics,
+                                const MPI_Comm               communicator)
+{
+  const double time_of[6] = { statistics.setup_time,
+                              statistics.marking_time,
+                              statistics.exchange_time,
+                              statistics.refinement_time,
+                              statistics.quality_time,
+                              statistics.output_time
+                            };
+  const char *const stage_names[6] = { "setup", "marking", "flag exchange",
+                                       "refinement", "quality", "output"
+                                     };
+
+  const MeshQualityStatistics quality
+    = merge_over_processes (statistics.quality, communicator);
+
+  ConditionalOStream pcout (std::cout,
+                            Utilities::MPI::this_mpi_process (communicator) == 0);
+  pcout << name << " on "
+        << Utilities::MPI::n_mpi_processes (communicator) << " process(es) with "
+        << MultithreadInfo::n_threads() << " thread(s) each: "
+        << Utilities::MPI::min (statistics.n_locally_owned_cells, communicator)
+        << " to "
+        << Utilities::MPI::max (statistics.n_locally_owned_cells, communicator)
+        << " cells per process" << std::endl;
+  double total_time = 0;
+  for (unsigned int i=0; i<6; ++i)
+    {
+      const double time = Utilities::MPI::max (time_of[i], communicator);
+      total_time += time;
+      pcout << "    " << std::setw(14) << std::left << stage_names[i]
+            << std::right << std::setw(12) << time << " s" << std::endl;
+    }
+  pcout << "    " << std::setw(14) << std::left << "total" << std::right
+        << std::setw(12) << total_time << " s" << std::endl
+        << "    triangulation memory: "
+        << Utilities::MPI::sum (statistics.triangulation_memory, communicator)
+        << " MB (summed over processes)" << std::endl;
+  if (Utilities::MPI::this_mpi_process (communicator) == 0)
+    quality.print (std::cout);
+}
+
+
+
+// All refinement in second_grid() happens at the inner boundary, so the
+// processes that own cells there get more and more of the mesh with each
+// step, unless the cells are redistributed. A distributed triangulation
+// does this by default at the end of every call to
+// execute_coarsening_and_refinement(): p4est cuts the space filling curve
+// through all cells into pieces of equal weight, one per process. Without
+// further information, every cell has the same weight. If some cells
+// are more expensive than others, for example because a solver does more
+// work at the boundary, the triangulation can be told so through its
+// <code>cell_weight</code> signal: every function connected to it is
+// called for every cell, and the weights they return are added to a base
+// weight of 1000 that every cell has. For a cell that is about to be
+// refined, the weight applies to each of its children.
+//
+// The following class connects a weight function of the user's choice to
+// this signal for as long as the object lives. It also computes how
+// unevenly the weight is distributed over the processes, measured by
+// the largest load of any process divided by the average load. This
+// ratio is 1 for a perfect distribution and tells how much longer the
+// slowest process takes than it would with a perfect one.
+typedef std::function<unsigned int (const Triangulation<2>::cell_iterator &)>
+CellWeightFunction;
+
+
+#ifdef DEAL_II_WITH_P4EST
+class CellWeights
+{
+public:
+  CellWeights (parallel::distributed::Triangulation<2> &triangulation,
+               const CellWeightFunction                &weight);
+  ~CellWeights ();
+
+  double load_imbalance () const;
+  double cell_imbalance () const;
+
+  static const unsigned int base_weight = 1000;
+
+private:
+  const parallel::distributed::Triangulation<2> &triangulation;
+  const CellWeightFunction                        weight;
+  boost::signals2::connection                     connection;
+};
+
+
+
+CellWeights::CellWeights (parallel::distributed::Triangulation<2> &triangulation,
+                          const CellWeightFunction                &weight)
+  :
+  triangulation (triangulation),
+  weight (weight)
+{
+  connection = triangulation.signals.cell_weight.connect
+               ([this] (const Triangulation<2>::cell_iterator &cell,
+                        const Triangulation<2>::CellStatus)
+  {
+    return this->weight (cell);
+  });
+}
+
+
+
+CellWeights::~CellWeights ()
+{
+  connection.disconnect ();
+}
+
+
+
+double CellWeights::load_imbalance () const
+{
+  double local_load = 0;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    if (cell->is_locally_owned())
+      local_load += base_weight + weight (cell);
+
+  const MPI_Comm communicator = triangulation.get_communicator();
+  const double total_load = Utilities::MPI::sum (local_load, communicator);
+  return Utilities::MPI::max (local_load, communicator)
+         / (total_load / Utilities::MPI::n_mpi_processes (communicator));
+}
+
+
+
+double CellWeights::cell_imbalance () const
+{
+  const std::vector<unsigned int> &n_cells
+    = triangulation.n_locally_owned_active_cells_per_processor();
+  return 1. * *std::max_element (n_cells.begin(), n_cells.end())
+         / (1. * triangulation.n_global_active_cells() / n_cells.size());
+}
+#endif
+
+
+
+// As an example of a weight function, and the one used by this program,
+// the following makes cells that touch the inner boundary more
+// expensive than all others by a given amount. Since the weight of a cell
+// about to be refined applies to its children, the function does not
+// check whether the cell is active:
+CellWeightFunction
+inner_boundary_cell_weight (const Point<2>     &center,
+                            const double        inner_radius,
+                            const unsigned int  extra_weight)
+{
+  return [=] (const Triangulation<2>::cell_iterator &cell) -> unsigned int
+  {
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      if (std::fabs (center.distance (cell->vertex(v)) - inner_radius)
+          < 1e-10)
+        return extra_weight;
+    return 0;
+  };
+}
+
+
+
+// Finally, the function that main() calls instead of second_grid() when a
+// parallel mode was selected. For a distributed triangulation, the
+// options decide whether cells are redistributed after each step and
+// whether cells at the boundary get a larger weight:
+void second_grid_in_parallel (const ProgramOptions &options)
+{
+  TraceScope trace_scope ("second grid in parallel");
+
+  AssertThrow (((options.checkpoint_interval == 0) && options.restart_file.empty())
+               ||
+               (options.parallel_mode == ParallelMode::distributed),
+               ExcMessage ("Checkpoints can only be written and read for "
+                           "--parallel=distributed."));
+
+  switch (options.parallel_mode)
+    {
+    case ParallelMode::shared:
+    {
+#ifdef DEAL_II_WITH_MPI
+      parallel::shared::Triangulation<2> triangulation (MPI_COMM_WORLD);
+      print_parallel_statistics ("Shared triangulation",
+                                 refine_ring_in_parallel (triangulation,
+                                                          options, "grid-2"),
+                                 MPI_COMM_WORLD);
+#else
+      AssertThrow (false,
+                   ExcMessage ("--parallel=shared requires deal.II to be "
+                               "configured with MPI."));
+#endif
+      break;
+    }
+
+    case ParallelMode::distributed:
+    {
+#ifdef DEAL_II_WITH_P4EST
+      parallel::distributed::Triangulation<2>
+      triangulation (MPI_COMM_WORLD,
+                     Triangulation<2>::none,
+                     options.repartition
+                     ?
+                     parallel::distributed::Triangulation<2>::default_setting
+                     :
+                     parallel::distributed::Triangulation<2>::no_automatic_repartitioning);
+      const CellWeights cell_weights (triangulation,
+                                      inner_boundary_cell_weight
+                                      (Point<2>(1,0), 0.5,
+                                       options.boundary_cell_weight));
+      const ParallelRunStatistics statistics
+        = refine_ring_in_parallel (triangulation, options, "grid-2");
+      print_parallel_statistics ("Distributed triangulation", statistics,
+                                 MPI_COMM_WORLD);
+      const double load_imbalance = cell_weights.load_imbalance();
+      if (Utilities::MPI::this_mpi_process (MPI_COMM_WORLD) == 0)
+        std::cout << "    load imbalance (max/average): " << load_imbalance
+                  << std::endl;
+#else
+      AssertThrow (false,
+                   ExcMessage ("--parallel=distributed requires deal.II to be "
+                               "configured with p4est."));
+#endif
+      break;
+    }
+
+    default:
+      Assert (false, ExcInternalError());
+    }
+}
+
+
+
+// @sect3{Benchmarks}
+
+// Besides creating the two grids above, this program can run a number of
+// benchmarks of the operations it consists of. Which one is selected with
+// the <code>--benchmark=name</code> command line option, and the functions
+// in this section implement them.
+//
+// Several benchmarks mark the same mesh more than once, and have to clear
+// the refine flags in between:
+void clear_refine_flags (Triangulation<2> &triangulation)
+{
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    cell->clear_refine_flag ();
+}
+
+
+
+// @sect4{A moving ring}
+
+// The refinement loop in second_grid() only ever refines, so the mesh can
+// only grow. Many applications instead follow a feature that moves through
+// the domain, refining where it is and coarsening where it was. The
+// following benchmark mimics this: the "target" circle starts at the inner
+// boundary of the ring and moves outward to the outer boundary over a
+// number of time steps. In each step, we refine cells the circle passes
+// through (up to a maximal level) and flag for coarsening cells that it
+// has left behind, and then let the triangulation do both at once.
+//
+// A cell is crossed by the circle if the circle's radius lies between the
+// smallest and largest distance of the cell's vertices from the center. A
+// cell has been "left behind" if it is further away from the circle than
+// its own diameter; the additional margin keeps cells from being refined
+// and coarsened again in consecutive steps.
+void moving_ring_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  // This time we follow the advice at the end of second_grid() and declare
+  // the manifold object before the triangulation, so that we do not have
+  // to detach it again at the end of the function:
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  GridGenerator::hyper_shell (triangulation,
+                              center, inner_radius, outer_radius,
+                              10);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (1);
+
+  // The cell count after every step goes into a file so that it can be
+  // plotted; the times of the two stages of every step are accumulated by
+  // a TimerOutput object that prints a summary at the end of the function:
+  const std::string filename = "moving-ring.dat" + options.output_suffix;
+  const std::unique_ptr<std::ostream> cell_counts = open_output_file (filename);
+  *cell_counts << "# step  radius  n_active_cells  n_vertices" << std::endl;
+
+  TimerOutput timer (std::cout, TimerOutput::summary, TimerOutput::wall_times);
+  Timer       total_time;
+
+  for (unsigned int step=0; step<options.n_time_steps; ++step)
+    {
+      const double radius = inner_radius
+                            + (outer_radius - inner_radius) * step
+                            / std::max (options.n_time_steps-1, 1u);
+
+      {
+        TimerOutput::Scope timer_section (timer, "Marking");
+
+        Triangulation<2>::active_cell_iterator
+        cell = triangulation.begin_active(),
+        endc = triangulation.end();
+        for (; cell!=endc; ++cell)
+          {
+            double min_distance = std::numeric_limits<double>::max(),
+                   max_distance = 0;
+            for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+              {
+                const double distance_from_center
+                  = center.distance (cell->vertex(v));
+                min_distance = std::min (min_distance, distance_from_center);
+                max_distance = std::max (max_distance, distance_from_center);
+              }
+
+            if ((min_distance <= radius) && (radius <= max_distance))
+              {
+                if (static_cast<unsigned int>(cell->level())
+                    < options.max_refinement_level)
+                  cell->set_refine_flag ();
+              }
+            else if ((cell->level() > 0)
+                     &&
+                     (std::min (std::fabs (min_distance - radius),
+                                std::fabs (max_distance - radius))
+                      > cell->diameter()))
+              cell->set_coarsen_flag ();
+          }
+      }
+
+      {
+        TimerOutput::Scope timer_section (timer, "Coarsening and refinement");
+        triangulation.execute_coarsening_and_refinement ();
+      }
+
+      *cell_counts << step << ' ' << radius << ' '
+                   << triangulation.n_active_cells() << ' '
+                   << triangulation.n_used_vertices() << '\n';
+
+      if ((step % std::max (options.n_time_steps/10, 1u) == 0)
+          || (step == options.n_time_steps-1))
+        std::cout << "  Step " << step
+                  << ", radius " << radius << ": "
+                  << triangulation.n_active_cells() << " active cells"
+                  << std::endl;
+    }
+
+  total_time.stop ();
+  close_output_file (*cell_counts);
+
+  std::cout << "Moving ring: " << options.n_time_steps << " steps in "
+            << total_time.wall_time() << " s, i.e., "
+            << 1e3 * total_time.wall_time() / options.n_time_steps
+            << " ms per step (amortized)." << std::endl
+            << "Cell counts written to " << filename << std::endl;
+}
+
+
+
+// @sect4{Cell-based vs. vertex-centric marking}
+
+// This benchmark compares the cell-based loop of
+// mark_inner_boundary_cells() with the vertex-centric marking of
+// mark_cells_at_circle_vertices(). In each refinement step, we let both
+// mark the same mesh, check that they flag the same cells, and record how
+// many distances each computed and how long it took. For the vertex-centric
+// variant, the time to update the vertex-to-cell map after refinement is
+// part of its cost, so we report it as well.
+void vertex_marking_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  GridGenerator::hyper_shell (triangulation,
+                              center, inner_radius, outer_radius,
+                              10);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+
+  VertexToCellMap vertex_to_cell_map (triangulation);
+
+  double total_cell_based_time     = 0,
+         total_vertex_centric_time = 0;
+  unsigned long total_cell_based_evaluations     = 0,
+                total_vertex_centric_evaluations = 0;
+
+  std::cout << "step  active_cells  cell_evals  vertex_evals"
+            << "  cell_time[s]  vertex_time[s]   map_update[s]"
+            << std::endl;
+
+  for (unsigned int step=0; step<options.n_refinement_steps; ++step)
+    {
+      // The cell-based loop stops looking at a cell's vertices once it has
+      // found one on the circle. We count its distance evaluations in a
+      // separate, untimed loop so as not to change the function itself:
+      unsigned long cell_based_evaluations = 0;
+      for (Triangulation<2>::active_cell_iterator
+           cell = triangulation.begin_active();
+           cell != triangulation.end(); ++cell)
+        for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+          {
+            ++cell_based_evaluations;
+            if (std::fabs (center.distance (cell->vertex(v))
+                           - inner_radius) < 1e-10)
+              break;
+          }
+
+      Timer timer;
+      mark_inner_boundary_cells (triangulation, center, inner_radius);
+      const double cell_based_time = timer.wall_time();
+
+      std::vector<bool> cell_based_flags;
+      triangulation.save_refine_flags (cell_based_flags);
+      triangulation.load_refine_flags
+      (std::vector<bool> (cell_based_flags.size(), false));
+
+      timer.restart ();
+      const unsigned int vertex_centric_evaluations
+        = mark_cells_at_circle_vertices (triangulation, vertex_to_cell_map,
+                                         center, inner_radius);
+      const double vertex_centric_time = timer.wall_time();
+
+      std::vector<bool> vertex_centric_flags;
+      triangulation.save_refine_flags (vertex_centric_flags);
+      AssertThrow (vertex_centric_flags == cell_based_flags,
+                   ExcMessage ("The two marking strategies flagged "
+                               "different cells."));
+
+      const unsigned int n_active_cells = triangulation.n_active_cells();
+      triangulation.execute_coarsening_and_refinement ();
+
+      std::cout << std::setw(4)  << step
+                << std::setw(14) << n_active_cells
+                << std::setw(12) << cell_based_evaluations
+                << std::setw(14) << vertex_centric_evaluations
+                << std::setw(14) << cell_based_time
+                << std::setw(16) << vertex_centric_time
+                << std::setw(16) << vertex_to_cell_map.last_update_time()
+                << std::endl;
+
+      total_cell_based_time            += cell_based_time;
+      total_vertex_centric_time        += vertex_centric_time
+                                          + vertex_to_cell_map.last_update_time();
+      total_cell_based_evaluations     += cell_based_evaluations;
+      total_vertex_centric_evaluations += vertex_centric_evaluations;
+    }
+
+  std::cout << "Distance evaluations reduced by a factor of "
+            << 1. * total_cell_based_evaluations
+            / std::max (total_vertex_centric_evaluations, 1ul)
+            << "; total marking time " << total_cell_based_time
+            << " s (cell-based) vs. " << total_vertex_centric_time
+            << " s (vertex-centric, including map updates)." << std::endl;
+}
+
+
+
+// @sect4{Generating a batch of meshes}
+
+// This benchmark runs generate_ring_meshes() on the configurations listed
+// in the file given by <code>--configurations=file</code> or, if there is
+// none, on <code>--n-meshes</code> rings with centers, radii and numbers
+// of cells that vary from one to the next. Each mesh is written to a file
+// of its own, or, with <code>--batch-output=none</code>, only counted, so
+// that the time for output can be separated from the time to generate the
+// meshes.
+std::vector<RingConfiguration>
+make_ring_configurations (const unsigned int n_meshes,
+                          const unsigned int n_refinement_steps)
+{
+  std::vector<RingConfiguration> configurations;
+  for (unsigned int i=0; i<n_meshes; ++i)
+    {
+      RingConfiguration configuration;
+      configuration.center                  = Point<2> (1.0 * (i % 7),
+                                                        1.0 * (i % 11));
+      configuration.inner_radius            = 0.25 + 0.05 * (i % 5);
+      configuration.outer_radius            = 1.0;
+      configuration.n_circumferential_cells = 6 + i % 20;
+      configuration.n_refinement_steps      = n_refinement_steps;
+      configurations.push_back (configuration);
+    }
+  return configurations;
+}
+
+
+
+void batch_benchmark (const ProgramOptions &options)
+{
+  const std::vector<RingConfiguration> configurations
+    = (options.configurations_file.empty() ?
+       make_ring_configurations (options.n_meshes, options.n_refinement_steps) :
+       read_ring_configurations (options.configurations_file));
+
+  std::atomic<unsigned long> n_cells (0);
+  const RingMeshCallback callback
+    = [&] (const unsigned int       index,
+           const RingConfiguration &,
+           const Triangulation<2>  &triangulation)
+  {
+    n_cells += triangulation.n_active_cells();
+
+    if (options.write_batch_output)
+      {
+        const std::unique_ptr<std::ostream> out
+          = open_output_file ("ring-" + Utilities::int_to_string (index, 5)
+                              + ".eps" + options.output_suffix);
+        GridOut().write_eps (triangulation, *out);
+        close_output_file (*out);
+      }
+  };
+
+  const double meshes_per_second
+    = generate_ring_meshes (configurations, callback);
+
+  std::cout << "Generated " << configurations.size() << " meshes with "
+            << n_cells << " cells in total: "
+            << meshes_per_second << " meshes per second." << std::endl;
+}
+
+
+
+// @sect4{Reading meshes}
+
+// This benchmark compares the throughput of import_mesh() with that of
+// deal.II's GridIn class, in elements per second. It reads the file given
+// by <code>--mesh-file</code> or, if there is none, first writes a ring
+// mesh refined globally <code>--refinement-steps</code> times to a text
+// MSH file. GridIn cannot read binary MSH files, so for those we only
+// time import_mesh().
+void import_benchmark (const ProgramOptions &options)
+{
+  std::string filename = options.input_mesh_file;
+  if (filename.empty())
+    {
+      filename = "import-benchmark.msh";
+
+      Triangulation<2> triangulation;
+      GridGenerator::hyper_shell (triangulation,
+                                  Point<2>(1,0), 0.5, 1.0, 10);
+      triangulation.refine_global (options.n_refinement_steps);
+
+      std::ofstream out (filename.c_str());
+      GridOut().write_msh (triangulation, out);
+    }
+
+  Timer timer;
+  Triangulation<2> imported_triangulation;
+  import_mesh (filename, imported_triangulation);
+  const double import_time = timer.wall_time();
+  const unsigned int n_cells = imported_triangulation.n_active_cells();
+
+  std::cout << "import_mesh(): " << n_cells << " cells in " << import_time
+            << " s, " << n_cells / import_time << " elements/s" << std::endl;
+
+  const std::string extension = filename.substr (filename.rfind ('.')+1);
+  bool is_binary = false;
+  if (extension == "msh")
+    {
+      std::ifstream in (filename.c_str());
+      std::string   line;
+      double        version;
+      int           binary;
+      std::getline (in, line);
+      in >> version >> binary;
+      is_binary = (binary != 0);
+    }
+
+  if (!is_binary)
+    {
+      timer.restart ();
+      Triangulation<2> triangulation;
+      GridIn<2> grid_in;
+      grid_in.attach_triangulation (triangulation);
+      std::ifstream in (filename.c_str());
+      if (extension == "msh")
+        grid_in.read_msh (in);
+      else
+        grid_in.read_ucd (in);
+      const double grid_in_time = timer.wall_time();
+
+      AssertThrow (triangulation.n_active_cells() == n_cells,
+                   ExcMessage ("GridIn and import_mesh() read different "
+                               "numbers of cells."));
+      std::cout << "GridIn:        " << n_cells << " cells in " << grid_in_time
+                << " s, " << n_cells / grid_in_time << " elements/s" << std::endl
+                << "Speedup: " << grid_in_time / import_time << std::endl;
+    }
+}
+
+
+// @sect4{Creating large coarse rings}
+
+// The coarse-ring benchmark times GridGenerator::hyper_shell() for numbers
+// of circumferential cells growing by factors of ten up to
+// <code>--max-circumferential-cells</code>, including attaching the
+// manifold ids, since every user of the ring needs them. For comparison,
+// we also time Triangulation::copy_triangulation() of the result, which
+// copies the finished data structures without setting up edges and
+// neighbors, and thus shows how much of the time goes into doing that
+// rather than into computing the vertices and cells.
+void coarse_ring_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  std::cout << "     cells  hyper_shell[s]     cells/s  copy[s]"
+            << std::endl;
+
+  for (unsigned int n_cells=10; n_cells<=options.max_circumferential_cells;
+       n_cells*=10)
+    {
+      Timer timer;
+      Triangulation<2> generated_ring;
+      GridGenerator::hyper_shell (generated_ring,
+                                  center, inner_radius, outer_radius,
+                                  n_cells);
+      generated_ring.set_all_manifold_ids (0);
+      const double generator_time = timer.wall_time();
+
+      timer.restart ();
+      Triangulation<2> copied_ring;
+      copied_ring.copy_triangulation (generated_ring);
+      const double copy_time = timer.wall_time();
+
+      std::cout << std::setw(10) << n_cells
+                << std::setw(16) << generator_time
+                << std::setw(12) << n_cells / generator_time
+                << std::setw(9)  << copy_time
+                << std::endl;
+
+      if (n_cells > options.max_circumferential_cells / 10)
+        break;
+    }
+}
+
+
+// @sect4{Flat vs. hierarchical marking}
+
+// This benchmark refines the ring towards the inner circle as second_grid()
+// does, and in every step marks the cells once with the flat loop of
+// mark_inner_boundary_cells() and once with the hierarchical traversal,
+// checking that both flag the same cells. It reports the time of both and
+// how many cells the traversal looked at, compared to the number of active
+// cells the flat loop looks at.
+//
+// What the traversal saves are the cells away from the circle. A mesh that
+// has only ever been refined at the circle has few of them: every step
+// adds three active cells for each cell on the circle, and the traversal
+// has to walk down to all of those anyway. The benchmark therefore first
+// refines the ring globally <code>--global-refinements</code> times, as an
+// application would that needs a minimal resolution everywhere, and the
+// traversal pays off once the cells away from the circle dominate.
+void traversal_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (options.n_global_refinements);
+
+  std::cout << "step  active_cells  visited_cells  flat_time[s]"
+            << "  hierarchical_time[s]  speedup" << std::endl;
+
+  for (unsigned int step=0; step<options.n_refinement_steps; ++step)
+    {
+      Timer timer;
+      mark_inner_boundary_cells (triangulation, center, inner_radius);
+      const double flat_time = timer.wall_time();
+
+      std::vector<bool> flat_flags;
+      triangulation.save_refine_flags (flat_flags);
+      triangulation.load_refine_flags
+      (std::vector<bool> (flat_flags.size(), false));
+
+      timer.restart ();
+      const unsigned long n_visited
+        = mark_inner_boundary_cells_hierarchically (triangulation, center,
+                                                    inner_radius);
+      const double hierarchical_time = timer.wall_time();
+
+      std::vector<bool> hierarchical_flags;
+      triangulation.save_refine_flags (hierarchical_flags);
+      AssertThrow (hierarchical_flags == flat_flags,
+                   ExcMessage ("The flat and the hierarchical marking "
+                               "flagged different cells."));
+
+      std::cout << std::setw(4)  << step
+                << std::setw(14) << triangulation.n_active_cells()
+                << std::setw(15) << n_visited
+                << std::setw(14) << flat_time
+                << std::setw(22) << hierarchical_time
+                << std::setw(9)  << flat_time / hierarchical_time
+                << std::endl;
+
+      triangulation.execute_coarsening_and_refinement ();
+    }
+}
+
+
+// @sect4{Caching vertex classifications}
+
+// This benchmark compares, step by step, the time of the flat marking
+// loop with that of the loop that uses the vertex classification cache,
+// along with the hit rate of the cache and the number of vertices it had
+// to classify, which should be the number of vertices created by the
+// previous step (and all of them in the first step). Both must flag the
+// same cells.
+void vertex_cache_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (options.n_global_refinements);
+
+  VertexClassificationCache cache (triangulation);
+
+  std::cout << "step  vertices  new_vertices  classified  hit_rate[%]"
+            << "  flat_time[s]  cached_time[s]" << std::endl;
+
+  unsigned int n_vertices_before = 0;
+  for (unsigned int step=0; step<options.n_refinement_steps; ++step)
+    {
+      Timer timer;
+      mark_inner_boundary_cells (triangulation, center, inner_radius);
+      const double flat_time = timer.wall_time();
+
+      std::vector<bool> flat_flags;
+      triangulation.save_refine_flags (flat_flags);
+      triangulation.load_refine_flags
+      (std::vector<bool> (flat_flags.size(), false));
+
+      cache.reset_statistics ();
+      timer.restart ();
+      mark_inner_boundary_cells_cached (triangulation, cache,
+                                        center, inner_radius);
+      const double cached_time = timer.wall_time();
+
+      std::vector<bool> cached_flags;
+      triangulation.save_refine_flags (cached_flags);
+      AssertThrow (cached_flags == flat_flags,
+                   ExcMessage ("The flat and the cached marking flagged "
+                               "different cells."));
+
+      const unsigned int n_vertices = triangulation.n_used_vertices();
+      std::cout << std::setw(4)  << step
+                << std::setw(10) << n_vertices
+                << std::setw(14) << n_vertices - n_vertices_before
+                << std::setw(12) << cache.n_misses()
+                << std::setw(13) << 100. * cache.n_hits()
+                / (cache.n_hits() + cache.n_misses())
+                << std::setw(14) << flat_time
+                << std::setw(16) << cached_time
+                << std::endl;
+
+      n_vertices_before = n_vertices;
+      triangulation.execute_coarsening_and_refinement ();
+    }
+}
+
+
+// @sect4{Templates vs. run-time dispatch of criteria}
+
+// To see what making criteria template arguments buys us, this benchmark
+// marks the same cells with the same criterion in four ways: with the two
+// template functions from above, and with two versions of the simple loop
+// that call the criterion at run time instead. The first of those builds
+// the criterion out of std::function objects, the second out of a class
+// hierarchy with a virtual function, with one call per node of the
+// expression in both cases, as a plug-in interface without templates would
+// have to. The criterion is the one of second_grid() plus the outer circle,
+// limited by a level:
+// @code
+//   (NearCircle (center, inner_radius) || NearCircle (center, outer_radius))
+//   && CoarserThan (max_refinement_level)
+// @endcode
+// evaluated on a ring that was refined globally
+// <code>--global-refinements</code> times.
+typedef std::function<double (const CellGeometry<double> &)> CriterionFunction;
+
+void mark_cells_where (Triangulation<2>        &triangulation,
+                       const CriterionFunction &criterion)
+{
+  CellGeometry<double> geometry;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    {
+      get_cell_geometry (cell, geometry);
+
+      if (criterion (geometry) > 0)
+        cell->set_refine_flag ();
+    }
+}
+
+
+
+class VirtualCriterion
+{
+public:
+  virtual ~VirtualCriterion () {}
+  virtual double value (const CellGeometry<double> &cell) const = 0;
+};
+
+
+
+template <class Criterion>
+class VirtualCriterionLeaf : public VirtualCriterion
+{
+public:
+  VirtualCriterionLeaf (const Criterion &criterion) : criterion (criterion) {}
+
+  virtual double value (const CellGeometry<double> &cell) const
+  {
+    return criterion (cell);
+  }
+
+private:
+  const Criterion criterion;
+};
+
+
+
+class VirtualAndCriterion : public VirtualCriterion
+{
+public:
+  VirtualAndCriterion (const VirtualCriterion &a, const VirtualCriterion &b)
+    : a (a), b (b) {}
+
+  virtual double value (const CellGeometry<double> &cell) const
+  {
+    return std::min (a.value (cell), b.value (cell));
+  }
+
+private:
+  const VirtualCriterion &a, &b;
+};
+
+
+
+class VirtualOrCriterion : public VirtualCriterion
+{
+public:
+  VirtualOrCriterion (const VirtualCriterion &a, const VirtualCriterion &b)
+    : a (a), b (b) {}
+
+  virtual double value (const CellGeometry<double> &cell) const
+  {
+    return std::max (a.value (cell), b.value (cell));
+  }
+
+private:
+  const VirtualCriterion &a, &b;
+};
+
+
+
+void mark_cells_where (Triangulation<2>       &triangulation,
+                       const VirtualCriterion &criterion)
+{
+  CellGeometry<double> geometry;
+  for (Triangulation<2>::active_cell_iterator
+       cell = triangulation.begin_active();
+       cell != triangulation.end(); ++cell)
+    {
+      get_cell_geometry (cell, geometry);
+
+      if (criterion.value (geometry) > 0)
+        cell->set_refine_flag ();
+    }
+}
+
+
+
+void criteria_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (options.n_global_refinements);
+
+  const NearCircle  near_inner (center, inner_radius),
+                    near_outer (center, outer_radius);
+  const CoarserThan coarse (options.max_refinement_level);
+
+  const CriterionFunction inner_function = near_inner,
+                          outer_function = near_outer,
+                          coarse_function = coarse;
+  const CriterionFunction or_function
+    = [&] (const CellGeometry<double> &cell)
+  {
+    return std::max (inner_function (cell), outer_function (cell));
+  };
+  const CriterionFunction and_function
+    = [&] (const CellGeometry<double> &cell)
+  {
+    return std::min (or_function (cell), coarse_function (cell));
+  };
+
+  const VirtualCriterionLeaf<NearCircle>  inner_virtual (near_inner),
+                                          outer_virtual (near_outer);
+  const VirtualCriterionLeaf<CoarserThan> coarse_virtual (coarse);
+  const VirtualOrCriterion                or_virtual (inner_virtual,
+                                                      outer_virtual);
+  const VirtualAndCriterion               and_virtual (or_virtual,
+                                                       coarse_virtual);
+
+  // Each variant is timed on the same mesh, and the flags are reset in
+  // between. The first variant's flags are the reference for the others:
+  std::vector<bool> reference_flags;
+  const auto time_marking = [&] (const std::string           &name,
+                                 const std::function<void ()> &mark)
+  {
+    clear_refine_flags (triangulation);
+
+    Timer timer;
+    mark ();
+    const double time = timer.wall_time();
+
+    std::vector<bool> flags;
+    triangulation.save_refine_flags (flags);
+    if (reference_flags.empty())
+      reference_flags = flags;
+    AssertThrow (flags == reference_flags,
+                 ExcMessage ("Marking with <" + name + "> flagged different "
+                             "cells than the template version."));
+
+    std::cout << "  " << std::setw(28) << std::left << name << std::right
+              << std::setw(12) << time << " s, "
+              << triangulation.n_active_cells() / time
+              << " cells/s" << std::endl;
+  };
+
+  std::cout << "Marking " << triangulation.n_active_cells()
+            << " cells:" << std::endl;
+  time_marking ("template", [&] ()
+  {
+    mark_cells_where (triangulation,
+                      (near_inner || near_outer) && coarse);
+  });
+  time_marking ("template, SIMD and threads", [&] ()
+  {
+    mark_cells_where_in_parallel (triangulation,
+                                  (near_inner || near_outer) && coarse);
+  });
+  time_marking ("std::function", [&] ()
+  {
+    mark_cells_where (triangulation, and_function);
+  });
+  time_marking ("virtual functions", [&] ()
+  {
+    mark_cells_where (triangulation,
+                      static_cast<const VirtualCriterion &>(and_virtual));
+  });
+}
+
+
+// @sect4{Scaling with the number of threads}
+
+// The parallel stages of this program are only worth their complexity if
+// they actually get faster with more threads. This benchmark runs each of
+// them with 1, 2, 4, ... threads up to the number of cores of the machine
+// (and with exactly that number if it is not a power of two) and reports,
+// for $p$ threads with run time $T_p$:
+// - the speedup $S_p = T_1/T_p$,
+// - the parallel efficiency $E_p = S_p/p$,
+// - the serial fraction $e_p = \frac{1/S_p - 1/p}{1 - 1/p}$ that Amdahl's
+//   law $S_p = \frac{1}{e + (1-e)/p}$ implies for the measured speedup
+//   (this is the Karp-Flatt metric). If $e_p$ stays the same as $p$
+//   grows, the stage is limited by a part that does not run in parallel,
+//   and no more than $1/e_p$ speedup can be expected; if it grows with
+//   $p$, the overhead of parallelization is growing too.
+//
+// The number of threads the task scheduler uses is set with
+// MultithreadInfo::set_thread_limit(). To get repeatable numbers, every
+// thread is pinned to its own core: the main thread to the first core
+// this process may run on, and each worker thread of the task scheduler,
+// when it starts working, to the next one. The following class does the
+// latter; the task scheduler calls its on_scheduler_entry() function on
+// every thread that joins it, and its on_scheduler_exit() function when
+// the thread leaves it. Threads that leave, and the main thread when the
+// object is destroyed, may again run on all cores the process was allowed
+// to run on before.
+#ifdef DEAL_II_WITH_THREADS
+class ThreadPinning : public tbb::task_scheduler_observer
+{
+public:
+  ThreadPinning ();
+  ~ThreadPinning ();
+
+  virtual void on_scheduler_entry (bool is_worker);
+  virtual void on_scheduler_exit (bool is_worker);
+
+private:
+  void pin_this_thread (const unsigned int index) const;
+
+  cpu_set_t                 original_cores;
+  std::vector<int>          allowed_cores;
+  std::atomic<unsigned int> next_index;
+};
+
+
+
+ThreadPinning::ThreadPinning ()
+  :
+  next_index (1)
+{
+  CPU_ZERO (&original_cores);
+  pthread_getaffinity_np (pthread_self(), sizeof(original_cores),
+                          &original_cores);
+  for (int core=0; core<CPU_SETSIZE; ++core)
+    if (CPU_ISSET (core, &original_cores))
+      allowed_cores.push_back (core);
+
+  pin_this_thread (0);
+  observe (true);
+}
+
+
+
+ThreadPinning::~ThreadPinning ()
+{
+  observe (false);
+  pthread_setaffinity_np (pthread_self(), sizeof(original_cores),
+                          &original_cores);
+}
+
+
+
+void ThreadPinning::on_scheduler_entry (bool is_worker)
+{
+  if (is_worker)
+    pin_this_thread (next_index++);
+}
+
+
+
+void ThreadPinning::on_scheduler_exit (bool is_worker)
+{
+  if (is_worker)
+    pthread_setaffinity_np (pthread_self(), sizeof(original_cores),
+                            &original_cores);
+}
+
+
+
+void ThreadPinning::pin_this_thread (const unsigned int index) const
+{
+  cpu_set_t core;
+  CPU_ZERO (&core);
+  CPU_SET (allowed_cores[index % allowed_cores.size()], &core);
+  pthread_setaffinity_np (pthread_self(), sizeof(core), &core);
+}
+#endif
+
+
+
+// The stages we measure are the parallel ones from above: the quality
+// check, marking by a criterion with SIMD and threads, the hierarchical
+// marking, reading a mesh file, and generating a batch of meshes. They run
+// on a ring refined globally <code>--global-refinements</code> times and a
+// batch of <code>--n-meshes</code> meshes, and each is timed three times,
+// of which we keep the fastest. Flags set by the marking stages are
+// cleared after each run, outside of the timed part.
+void thread_scaling_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (options.n_global_refinements);
+
+  const std::string mesh_file = "thread-scaling.msh";
+  {
+    std::ofstream out (mesh_file.c_str());
+    GridOut().write_msh (triangulation, out);
+  }
+
+  const std::vector<RingConfiguration> configurations
+    = make_ring_configurations (options.n_meshes, options.n_refinement_steps);
+
+  const std::vector<std::pair<std::string,std::function<void ()> > > stages =
+  {
+    {
+      "mesh quality", [&] ()
+      {
+        compute_mesh_quality (triangulation);
+      }
+    },
+    {
+      "criterion marking", [&] ()
+      {
+        mark_cells_where_in_parallel (triangulation,
+                                      NearCircle (center, inner_radius)
+                                      && CoarserThan (options.max_refinement_level));
+      }
+    },
+    {
+      "hierarchical marking", [&] ()
+      {
+        mark_inner_boundary_cells_hierarchically (triangulation, center,
+                                                  inner_radius);
+      }
+    },
+    {
+      "mesh import", [&] ()
+      {
+        Triangulation<2> imported_triangulation;
+        import_mesh (mesh_file, imported_triangulation);
+      }
+    },
+    {
+      "batch generation", [&] ()
+      {
+        generate_ring_meshes (configurations,
+                              [] (const unsigned int,
+                                  const RingConfiguration &,
+                                  const Triangulation<2> &) {});
+      }
+    }
+  };
+
+  std::vector<unsigned int> thread_counts;
+  const unsigned int n_cores = MultithreadInfo::n_cores();
+  for (unsigned int p=1; p<n_cores; p*=2)
+    thread_counts.push_back (p);
+  thread_counts.push_back (n_cores);
+
+  // times[s][t] is the time of stage <code>s</code> with
+  // <code>thread_counts[t]</code> threads:
+  std::vector<std::vector<double> > times (stages.size(),
+                                           std::vector<double> (thread_counts.size()));
+  for (unsigned int t=0; t<thread_counts.size(); ++t)
+    {
+      MultithreadInfo::set_thread_limit (thread_counts[t]);
+#ifdef DEAL_II_WITH_THREADS
+      const ThreadPinning thread_pinning;
+#endif
+
+      for (unsigned int s=0; s<stages.size(); ++s)
+        {
+          times[s][t] = std::numeric_limits<double>::max();
+          for (unsigned int repetition=0; repetition<3; ++repetition)
+            {
+              Timer timer;
+              stages[s].second ();
+              times[s][t] = std::min (times[s][t], timer.wall_time());
+              clear_refine_flags (triangulation);
+            }
+        }
+    }
+  MultithreadInfo::set_thread_limit ();
+
+  std::cout << "stage                  threads     time[s]  speedup"
+            << "  efficiency  serial_fraction" << std::endl;
+  for (unsigned int s=0; s<stages.size(); ++s)
+    for (unsigned int t=0; t<thread_counts.size(); ++t)
+      {
+        const unsigned int p       = thread_counts[t];
+        const double       speedup = times[s][0] / times[s][t];
+
+        std::cout << std::setw(22) << std::left << stages[s].first << std::right
+                  << std::setw(8)  << p
+                  << std::setw(12) << times[s][t]
+                  << std::setw(9)  << speedup
+                  << std::setw(12) << speedup / p;
+        if (p > 1)
+          std::cout << std::setw(17) << (1./speedup - 1./p) / (1. - 1./p);
+        std::cout << std::endl;
+      }
+}
+
+
+// @sect4{Serial vs. shared vs. distributed triangulations}
+
+// This benchmark runs the refinement of second_grid() first on a serial
+// triangulation on the first process alone, then on a shared and on a
+// distributed triangulation on all processes, and prints time and memory
+// of each as described for print_parallel_statistics(). It is meant to be
+// run with <code>mpirun</code> on a single node.
+//
+// While the first process works on the serial triangulation, the others
+// have to wait for it. Most MPI libraries wait for messages by busy
+// polling, so waiting in MPI_Barrier() would keep all cores of the node
+// busy and slow down the one process that does the work, in particular if
+// it runs several threads. The following function therefore polls a
+// non-blocking barrier instead and, if asked to, sleeps in between. The
+// benchmark of the next section uses it as well.
+#ifdef DEAL_II_WITH_MPI
+void wait_for_all_processes (const MPI_Comm communicator,
+                             const bool     sleep_while_waiting)
+{
+  MPI_Request request;
+  MPI_Ibarrier (communicator, &request);
+  int done = 0;
+  while (!done)
+    {
+      MPI_Test (&request, &done, MPI_STATUS_IGNORE);
+      if (!done && sleep_while_waiting)
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+}
+#endif
+
+
+
+void parallel_modes_benchmark (const ProgramOptions &options)
+{
+  if (Utilities::MPI::this_mpi_process (MPI_COMM_WORLD) == 0)
+    {
+      Triangulation<2> triangulation;
+      print_parallel_statistics ("Serial triangulation",
+                                 refine_ring_in_parallel (triangulation,
+                                                          options, ""),
+                                 MPI_COMM_SELF);
+    }
+
+#ifdef DEAL_II_WITH_MPI
+  {
+    wait_for_all_processes (MPI_COMM_WORLD,
+                            Utilities::MPI::this_mpi_process (MPI_COMM_WORLD) != 0);
+    parallel::shared::Triangulation<2> triangulation (MPI_COMM_WORLD);
+    print_parallel_statistics ("Shared triangulation",
+                               refine_ring_in_parallel (triangulation,
+                                                        options, ""),
+                               MPI_COMM_WORLD);
+  }
+#endif
+
+#ifdef DEAL_II_WITH_P4EST
+  {
+    parallel::distributed::Triangulation<2> triangulation (MPI_COMM_WORLD);
+    print_parallel_statistics ("Distributed triangulation",
+                               refine_ring_in_parallel (triangulation,
+                                                        options, ""),
+                               MPI_COMM_WORLD);
+  }
+#endif
+}
+
+
+// @sect4{Repartitioning after refinement}
+
+// This benchmark shows how the load balance of a distributed triangulation
+// develops over the refinement steps of second_grid(). It runs once
+// without redistributing the cells after each step, so that all cells stay
+// with the process that owned their coarse cell, and once with
+// redistribution according to the weights of the CellWeights class. For
+// each step it prints the number of cells, the imbalance of the number of
+// cells and of the weighted load, and the time
+// execute_coarsening_and_refinement() took, including the
+// redistribution. It is meant to be run with <code>mpirun</code>;
+// <code>--boundary-cell-weight</code> sets by how much a cell at the inner
+// boundary is more expensive than others.
+void repartitioning_benchmark (const ProgramOptions &options)
+{
+#ifdef DEAL_II_WITH_P4EST
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+  const SphericalManifold<2> manifold_description(center);
+
+  ConditionalOStream pcout (std::cout,
+                            Utilities::MPI::this_mpi_process (MPI_COMM_WORLD) == 0);
+  pcout << "Refining on " << Utilities::MPI::n_mpi_processes (MPI_COMM_WORLD)
+        << " processes, boundary cells have weight "
+        << CellWeights::base_weight + options.boundary_cell_weight
+        << " instead of " << CellWeights::base_weight << std::endl;
+
+  for (unsigned int repartition=0; repartition<2; ++repartition)
+    {
+      parallel::distributed::Triangulation<2>
+      triangulation (MPI_COMM_WORLD,
+                     Triangulation<2>::none,
+                     repartition
+                     ?
+                     parallel::distributed::Triangulation<2>::default_setting
+                     :
+                     parallel::distributed::Triangulation<2>::no_automatic_repartitioning);
+      const CellWeights cell_weights (triangulation,
+                                      inner_boundary_cell_weight
+                                      (center, inner_radius,
+                                       options.boundary_cell_weight));
+
+      create_ring (triangulation, center, inner_radius, outer_radius,
+                   options.n_circumferential_cells);
+      triangulation.set_all_manifold_ids(0);
+      triangulation.set_manifold (0, manifold_description);
+
+      pcout << (repartition ? "With" : "Without") << " repartitioning:"
+            << std::endl
+            << "    step       cells  cell imbalance  load imbalance    time [s]"
+            << std::endl;
+      for (unsigned int step=0; step<options.n_refinement_steps; ++step)
+        {
+          mark_locally_owned_inner_boundary_cells (triangulation, center,
+                                                   inner_radius);
+
+          MPI_Barrier (MPI_COMM_WORLD);
+          Timer timer;
+          triangulation.execute_coarsening_and_refinement ();
+          const double time = Utilities::MPI::max (timer.wall_time(),
+                                                   MPI_COMM_WORLD);
+
+          const double cell_imbalance = cell_weights.cell_imbalance();
+          const double load_imbalance = cell_weights.load_imbalance();
+          pcout << std::setw(8) << step+1
+                << std::setw(12) << triangulation.n_global_active_cells()
+                << std::setw(16) << cell_imbalance
+                << std::setw(16) << load_imbalance
+                << std::setw(12) << time << std::endl;
+        }
+
+      triangulation.set_manifold (0);
+    }
+#else
+  (void)options;
+  AssertThrow (false,
+               ExcMessage ("The repartitioning benchmark requires deal.II to "
+                           "be configured with p4est."));
+#endif
+}
+
+
+// @sect4{Processes vs. threads}
+
+// The cores of a machine can be used by one process with as many threads
+// as there are cores, by one single-threaded process per core, or by
+// anything in between. This benchmark compares these layouts for the
+// parallel version of second_grid(), on a distributed triangulation if
+// deal.II has p4est and on a shared one otherwise. It is meant to be
+// started with one process per core, e.g. as
+// @code
+//   mpirun -np 16 --bind-to none ./ring_refinement --benchmark=layouts
+// @endcode
+// (without <code>--bind-to none</code>, MPI may pin each process to a
+// single core, and its threads could not run anywhere else). For each
+// number of processes $R$ = 1, 2, 4, ... up to the number $P$ of processes
+// started, the first $R$ of them each run with $\lfloor P/R \rfloor$
+// threads, and print the statistics of print_parallel_statistics(). The
+// other processes wait in wait_for_all_processes() until the layout is
+// done, so that they do not take the cores away from the working ones.
+void layouts_benchmark (const ProgramOptions &options)
+{
+#ifdef DEAL_II_WITH_MPI
+#ifdef DEAL_II_WITH_P4EST
+  typedef parallel::distributed::Triangulation<2> LayoutTriangulation;
+#else
+  typedef parallel::shared::Triangulation<2>      LayoutTriangulation;
+#endif
+
+  const unsigned int n_processes = Utilities::MPI::n_mpi_processes (MPI_COMM_WORLD);
+  const unsigned int process     = Utilities::MPI::this_mpi_process (MPI_COMM_WORLD);
+
+  std::vector<unsigned int> layouts;
+  for (unsigned int n=1; n<n_processes; n*=2)
+    layouts.push_back (n);
+  layouts.push_back (n_processes);
+
+  for (unsigned int l=0; l<layouts.size(); ++l)
+    {
+      const unsigned int n_working_processes = layouts[l];
+      const unsigned int n_threads           = n_processes / n_working_processes;
+      const bool         is_working          = (process < n_working_processes);
+
+      MPI_Comm communicator;
+      MPI_Comm_split (MPI_COMM_WORLD, is_working ? 0 : MPI_UNDEFINED, process,
+                      &communicator);
+
+      if (is_working)
+        {
+          MultithreadInfo::set_thread_limit (n_threads);
+          {
+            LayoutTriangulation triangulation (communicator);
+            print_parallel_statistics (Utilities::int_to_string (n_working_processes)
+                                       + " x " + Utilities::int_to_string (n_threads),
+                                       refine_ring_in_parallel (triangulation,
+                                                                options, "layout"),
+                                       communicator);
+          }
+          MPI_Comm_free (&communicator);
+        }
+
+      wait_for_all_processes (MPI_COMM_WORLD, !is_working);
+    }
+  MultithreadInfo::set_thread_limit (options.threads_per_process);
+#else
+  (void)options;
+  AssertThrow (false,
+               ExcMessage ("The layouts benchmark requires deal.II to be "
+                           "configured with MPI."));
+#endif
+}
+
+
+// @sect4{Refining toward a cloud of points}
+
+// This benchmark shows how the cost of marking cells near a point cloud
+// grows with the number of points. It refines the ring of second_grid()
+// <code>--global-refinements</code> times, and then for point clouds of
+// 1000, 10000, ... up to <code>--n-points</code> points scattered around a
+// circle inside the ring, reports the time to read the file and build the
+// k-d tree, the time to mark cells using the tree, and the time to mark
+// them by testing every cell against every point. The latter is done on
+// the same number of threads, but is skipped once it would take
+// too long; where it is done, the benchmark checks that both mark the same
+// cells.
+void mark_cells_near_points_without_tree (Triangulation<2>             &triangulation,
+                                          const std::vector<Point<2> > &points,
+                                          const double                  tolerance)
+{
+  mark_cells_in_parallel (triangulation,
+                          [&] (const Triangulation<2>::active_cell_iterator &cell)
+  {
+    for (unsigned int p=0; p<points.size(); ++p)
+      if (distance_to_cell_hull (cell, points[p]) <= tolerance)
+        return true;
+    return false;
+  });
+}
+
+
+
+void point_cloud_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (options.n_global_refinements);
+
+  const std::string points_file = "point-cloud.txt";
+  const double      max_n_distance_tests = 1e9;
+
+  std::cout << "Marking " << triangulation.n_active_cells() << " cells:"
+            << std::endl
+            << "  points  marked  read+build[s]  with tree[s]  without tree[s]"
+            << std::endl;
+
+  std::mt19937 random_number_generator (0);
+  std::uniform_real_distribution<double> uniform (0, 1);
+  for (unsigned int n_points=1000; ; n_points*=10)
+    {
+      n_points = std::min (n_points, options.n_points);
+
+      std::vector<Point<2> > points (n_points);
+      for (unsigned int i=0; i<n_points; ++i)
+        {
+          const double angle  = 2 * numbers::PI * uniform (random_number_generator),
+                       radius = 0.75 + 0.05 * (uniform (random_number_generator) - 0.5);
+          points[i] = center + radius * Point<2> (std::cos (angle), std::sin (angle));
+        }
+      {
+        std::ofstream out (points_file.c_str());
+        out.precision (17);
+        for (unsigned int i=0; i<n_points; ++i)
+          out << points[i][0] << ' ' << points[i][1] << '\n';
+      }
+
+      Timer timer;
+      const PointCloud point_cloud = read_point_cloud (points_file);
+      const double read_time = timer.wall_time();
+
+      timer.restart ();
+      mark_cells_near_points (triangulation, point_cloud,
+                              options.point_tolerance);
+      const double tree_time = timer.wall_time();
+
+      std::vector<bool> flags_with_tree;
+      triangulation.save_refine_flags (flags_with_tree);
+      clear_refine_flags (triangulation);
+
+      std::cout << std::setw(8)  << n_points
+                << std::setw(8)  << std::count (flags_with_tree.begin(),
+                                                flags_with_tree.end(), true)
+                << std::setw(15) << read_time
+                << std::setw(14) << tree_time;
+
+      if (1. * n_points * triangulation.n_active_cells() <= max_n_distance_tests)
+        {
+          timer.restart ();
+          mark_cells_near_points_without_tree (triangulation, points,
+                                               options.point_tolerance);
+          const double brute_force_time = timer.wall_time();
+
+          std::vector<bool> flags_without_tree;
+          triangulation.save_refine_flags (flags_without_tree);
+          clear_refine_flags (triangulation);
+
+          std::cout << std::setw(17) << brute_force_time;
+          AssertThrow (flags_with_tree == flags_without_tree,
+                       ExcMessage ("Marking with and without the k-d tree "
+                                   "marked different cells."));
+        }
+      else
+        std::cout << std::setw(17) << "-";
+      std::cout << std::endl;
+
+      if (n_points == options.n_points)
+        break;
+    }
+}
+
+
+// @sect4{Evaluating signed distance functions}
+
+// This benchmark compares three ways of marking the cells near the example
+// surface of mark_cells_near_surface() on the ring of second_grid(),
+// refined <code>--global-refinements</code> times. The first evaluates the
+// signed distance function for the four vertices of each cell, one vertex
+// at a time; the second is mark_cells_near_surface(), which evaluates it
+// once per vertex and for several vertices at once. Both should mark the
+// same cells; since the compiler may round the scalar and the vectorized
+// arithmetic differently, cells with a vertex exactly on the surface can
+// be the exception, and the benchmark reports how many cells are marked
+// differently. The third uses the same function
+// sampled on a grid of 1024x1024 points, written to a file and read back
+// in, and shows what interpolating costs compared to evaluating the
+// formula, and how many cells it marks differently.
+template <class SDF>
+void mark_cells_near_surface_per_cell (Triangulation<2>          &triangulation,
+                                       const SignedDistance<SDF> &signed_distance,
+                                       const double               band_width)
+{
+  mark_cells_in_parallel (triangulation,
+                          [&] (const Triangulation<2>::active_cell_iterator &cell)
+  {
+    double cell_values[4];
+    for (unsigned int v=0; v<GeometryInfo<2>::vertices_per_cell; ++v)
+      cell_values[v] = signed_distance.derived() (cell->vertex(v)[0],
+                                                  cell->vertex(v)[1]);
+    return is_near_surface (cell_values, cell->diameter(), band_width);
+  });
+}
+
+
+
+void signed_distance_benchmark (const ProgramOptions &options)
+{
+  const Point<2> center (1,0);
+  const double inner_radius = 0.5,
+               outer_radius = 1.0;
+
+  const SphericalManifold<2> manifold_description(center);
+  Triangulation<2> triangulation;
+  create_ring (triangulation, center, inner_radius, outer_radius,
+               options.n_circumferential_cells);
+  triangulation.set_all_manifold_ids(0);
+  triangulation.set_manifold (0, manifold_description);
+  triangulation.refine_global (options.n_global_refinements);
+
+  const ExampleSurface surface = example_surface (center);
+
+  const std::string  sampled_file = "signed-distance.txt";
+  const unsigned int n_samples    = 1024;
+  {
+    const Point<2> lower_corner = center - Point<2> (outer_radius, outer_radius),
+                   upper_corner = center + Point<2> (outer_radius, outer_radius);
+    std::ofstream out (sampled_file.c_str());
+    out.precision (17);
+    out << n_samples << ' ' << n_samples << ' '
+        << lower_corner[0] << ' ' << lower_corner[1] << ' '
+        << upper_corner[0] << ' ' << upper_corner[1] << '\n';
+    for (unsigned int j=0; j<n_samples; ++j)
+      {
+        for (unsigned int i=0; i<n_samples; ++i)
+          out << surface (lower_corner[0] + (upper_corner[0] - lower_corner[0])
+                          * i / (n_samples - 1),
+                          lower_corner[1] + (upper_corner[1] - lower_corner[1])
+                          * j / (n_samples - 1))
+              << ' ';
+        out << '\n';
+      }
+  }
+  const SampledDistance sampled_surface = read_sampled_distance (sampled_file);
+
+  // Each way of marking is timed three times, of which we keep the
+  // fastest, and returns the flags it set:
+  const auto time_marking = [&] (const std::function<void ()> &mark,
+                                 std::vector<bool>            &flags)
+  {
+    double time = std::numeric_limits<double>::max();
+    for (unsigned int repetition=0; repetition<3; ++repetition)
+      {
+        Timer timer;
+        mark ();
+        time = std::min (time, timer.wall_time());
+
+        triangulation.save_refine_flags (flags);
+        clear_refine_flags (triangulation);
+      }
+    return time;
+  };
+
+  std::vector<bool> flags_per_cell, flags_per_vertex, flags_sampled;
+  const double time_per_cell = time_marking ([&] ()
+  {
+    mark_cells_near_surface_per_cell (triangulation, surface,
+                                      options.surface_band_width);
+  }, flags_per_cell);
+  const double time_per_vertex = time_marking ([&] ()
+  {
+    mark_cells_near_surface (triangulation, surface,
+                             options.surface_band_width);
+  }, flags_per_vertex);
+  const double time_sampled = time_marking ([&] ()
+  {
+    mark_cells_near_surface (triangulation, sampled_surface,
+                             options.surface_band_width);
+  }, flags_sampled);
+
+  const auto count_differences = [] (const std::vector<bool> &a,
+                                     const std::vector<bool> &b)
+  {
+    unsigned int n_differences = 0;
+    for (unsigned int i=0; i<a.size(); ++i)
+      if (a[i] != b[i])
+        ++n_differences;
+    return n_differences;
+  };
+
+  std::cout << "Marking " << triangulation.n_active_cells() << " cells with "
+            << triangulation.n_vertices() << " vertices:" << std::endl
+            << "    per cell, one vertex at a time: " << time_per_cell << " s, "
+            << std::count (flags_per_cell.begin(), flags_per_cell.end(), true)
+            << " cells marked" << std::endl
+            << "    per vertex, "
+            << VectorizedArray<double>::n_array_elements
+            << " vertices at a time: " << time_per_vertex << " s ("
+            << time_per_cell / time_per_vertex << "x faster), "
+            << count_differences (flags_per_cell, flags_per_vertex)
+            << " cells marked differently" << std::endl
+            << "    sampled on " << n_samples << "x" << n_samples
+            << " points:        " << time_sampled << " s, "
+            << std::count (flags_sampled.begin(), flags_sampled.end(), true)
+            << " cells marked, "
+            << count_differences (flags_sampled, flags_per_vertex)
+            << " differently"
+            << std::endl;
+}
+
+
+
+// @sect4{Selecting a benchmark}
+
+// The function called from main() if a benchmark was requested:
+void run_benchmark (const ProgramOptions &options)
+{
+  if (options.benchmark == "moving-ring")
+    moving_ring_benchmark (options);
+  else if (options.benchmark == "vertex-marking")
+    vertex_marking_benchmark (options);
+  else if (options.benchmark == "batch")
+    batch_benchmark (options);
+  else if (options.benchmark == "import")
+    import_benchmark (options);
+  else if (options.benchmark == "coarse-ring")
+    coarse_ring_benchmark (options);
+  else if (options.benchmark == "traversal")
+    traversal_benchmark (options);
+  else if (options.benchmark == "vertex-cache")
+    vertex_cache_benchmark (options);
+  else if (options.benchmark == "criteria")
+    criteria_benchmark (options);
+  else if (options.benchmark == "thread-scaling")
+    thread_scaling_benchmark (options);
+  else if (options.benchmark == "parallel-modes")
+    parallel_modes_benchmark (options);
+  else if (options.benchmark == "repartitioning")
+    repartitioning_benchmark (options);
+  else if (options.benchmark == "layouts")
+    layouts_benchmark (options);
+  else if (options.benchmark == "point-cloud")
+    point_cloud_benchmark (options);
+  else if (options.benchmark == "signed-distance")
+    signed_distance_benchmark (options);
+  else
+    AssertThrow (false,
+                 ExcMessage ("Unknown benchmark <" + options.benchmark
+                             + ">."));
+}
+
+
+
+// @sect3{Parsing the command line}
+
+// The program accepts a number of options of the form
+// <code>--name=value</code>. Anything we do not recognize is an error,
+// since silently ignoring a typo in a benchmark setting would produce
+// misleading results.
+ProgramOptions parse_command_line (const int argc, char **argv)
+{
+  ProgramOptions options;
+
+  for (int i=1; i<argc; ++i)
+    {
+      const std::string argument = argv[i];
+      const std::string::size_type equals = argument.find ('=');
+      const std::string name  = argument.substr (0, equals);
+      const std::string value = (equals == std::string::npos ?
+                                 "" :
+                                 argument.substr (equals+1));
+
+      if (name == "--compress")
+        {
+          if (value == "none")
+            options.output_suffix = "";
+          else if (value == "gzip")
+            options.output_suffix = ".gz";
+          else if (value == "zstd")
+            options.output_suffix = ".zst";
+          else
+            AssertThrow (false,
+                         ExcMessage ("Unknown compression method <" + value
+                                     + ">. Use one of none, gzip, zstd."));
+        }
+      else if (name == "--mesh-file")
+        options.input_mesh_file = value;
+      else if (name == "--output-formats")
+        options.output_formats = Utilities::split_string_list (value, ',');
+      else if (name == "--curved-output")
+        options.write_curved_output = true;
+      else if (name == "--mapping-degree")
+        options.mapping_degree = Utilities::string_to_int (value);
+      else if (name == "--circumferential-cells")
+        {
+          options.n_circumferential_cells = Utilities::string_to_int (value);
+          AssertThrow (options.n_circumferential_cells >= 3,
+                       ExcMessage ("A ring needs at least three cells "
+                                   "around its circumference."));
+        }
+      else if (name == "--refinement-strategy")
+        {
+          if (value == "inner-boundary")
+            options.refinement_strategy = RefinementStrategy::inner_boundary;
+          else if (value == "fixed-number")
+            options.refinement_strategy = RefinementStrategy::fixed_number;
+          else if (value == "fixed-fraction")
+            options.refinement_strategy = RefinementStrategy::fixed_fraction;
+          else if (value == "vertex-centric")
+            options.refinement_strategy = RefinementStrategy::vertex_centric;
+          else if (value == "hierarchical")
+            options.refinement_strategy = RefinementStrategy::hierarchical;
+          else if (value == "cached")
+            options.refinement_strategy = RefinementStrategy::cached;
+          else if (value == "point-cloud")
+            options.refinement_strategy = RefinementStrategy::point_cloud;
+          else if (value == "signed-distance")
+            options.refinement_strategy = RefinementStrategy::signed_distance;
+          else
+            AssertThrow (false,
+                         ExcMessage ("Unknown refinement strategy <" + value
+                                     + ">. Use one of inner-boundary, "
+                                     "fixed-number, fixed-fraction, "
+                                     "vertex-centric, hierarchical, cached, "
+                                     "point-cloud, signed-distance."));
+        }
+      else if (name == "--points")
+        options.point_cloud_file = value;
+      else if (name == "--point-tolerance")
+        options.point_tolerance = Utilities::string_to_double (value);
+      else if (name == "--signed-distance")
+        options.signed_distance_file = value;
+      else if (name == "--band-width")
+        options.surface_band_width = Utilities::string_to_double (value);
+      else if (name == "--refinement-steps")
+        options.n_refinement_steps = Utilities::string_to_int (value);
+      else if (name == "--quality")
+        options.report_mesh_quality = true;
+      else if (name == "--refine-fraction")
+        options.refine_fraction = Utilities::string_to_double (value);
+      else if (name == "--coarsen-fraction")
+        options.coarsen_fraction = Utilities::string_to_double (value);
+      else if (name == "--max-cells")
+        options.max_n_cells = Utilities::string_to_int (value);
+      else if (name == "--memory-budget")
+        options.memory_budget = Utilities::string_to_int (value);
+      else if (name == "--over-budget")
+        {
+          if (value == "stop")
+            options.over_budget_action = OverBudgetAction::stop;
+          else if (value == "degrade")
+            options.over_budget_action = OverBudgetAction::degrade;
+          else if (value == "error")
+            options.over_budget_action = OverBudgetAction::error;
+          else
+            AssertThrow (false,
+                         ExcMessage ("Unknown value <" + value
+                                     + "> for --over-budget. Use one of "
+                                     "stop, degrade, error."));
+        }
+      else if (name == "--forecast")
+        options.report_memory_forecast = true;
+      else if (name == "--trace")
+        options.trace_file = value;
+      else if (name == "--telemetry")
+        options.telemetry_file = value;
+      else if (name == "--parallel")
+        {
+          if (value == "serial")
+            options.parallel_mode = ParallelMode::serial;
+          else if (value == "shared")
+            options.parallel_mode = ParallelMode::shared;
+          else if (value == "distributed")
+            options.parallel_mode = ParallelMode::distributed;
+          else
+            AssertThrow (false,
+                         ExcMessage ("Unknown parallel mode <" + value
+                                     + ">. Use one of serial, shared, "
+                                     "distributed."));
+        }
+      else if (name == "--threads-per-process")
+        {
+          options.threads_per_process = Utilities::string_to_int (value);
+          AssertThrow (options.threads_per_process >= 1,
+                       ExcMessage ("Each process needs at least one thread."));
+        }
+      else if (name == "--no-repartitioning")
+        options.repartition = false;
+      else if (name == "--boundary-cell-weight")
+        options.boundary_cell_weight = Utilities::string_to_int (value);
+      else if (name == "--checkpoint-every")
+        options.checkpoint_interval = Utilities::string_to_int (value);
+      else if (name == "--restart")
+        options.restart_file = value;
+      else if (name == "--subdomains")
+        options.n_subdomains = Utilities::string_to_int (value);
+      else if (name == "--partitioner")
+        {
+          if (value == "zorder")
+            options.partitioner = Partitioner::zorder;
+          else if (value == "metis")
+            options.partitioner = Partitioner::metis;
+          else
+            AssertThrow (false,
+                         ExcMessage ("Unknown partitioner <" + value
+                                     + ">. Use one of zorder, metis."));
+        }
+      else if (name == "--benchmark")
+        options.benchmark = value;
+      else if (name == "--time-steps")
+        options.n_time_steps = Utilities::string_to_int (value);
+      else if (name == "--max-level")
+        options.max_refinement_level = Utilities::string_to_int (value);
+      else if (name == "--configurations")
+        options.configurations_file = value;
+      else if (name == "--n-meshes")
+        options.n_meshes = Utilities::string_to_int (value);
+      else if (name == "--max-circumferential-cells")
+        options.max_circumferential_cells = Utilities::string_to_int (value);
+      else if (name == "--global-refinements")
+        options.n_global_refinements = Utilities::string_to_int (value);
+      else if (name == "--n-points")
+        options.n_points = Utilities::string_to_int (value);
+      else if (name == "--batch-output")
+        {
+          AssertThrow ((value == "files") || (value == "none"),
+                       ExcMessage ("Unknown batch output <" + value
+                                   + ">. Use one of files, none."));
+          options.write_batch_output = (value == "files");
+        }
+      else
+        AssertThrow (false,
+                     ExcMessage ("Unknown command line argument <"
+                                 + argument + ">."));
+    }
+
+  return options;
+}
+
+
+
+// @sect3{The main function}
+
+// Finally, the main function. There isn't much to do here, only to read the
+// command line and to call the two subfunctions, which produce the two
+// grids, or to run the benchmark that was asked for instead. As in most
+// other programs, we catch exceptions here and print what went wrong.
+int main (int argc, char **argv)
+{
+  try
+    {
+      const ProgramOptions options = parse_command_line (argc, argv);
+
+      // Initialize MPI if the program was started with
+      // <code>mpirun</code>; this works, and does nothing, if it was
+      // started without it or deal.II was configured without MPI. The last
+      // argument is the number of threads the task scheduler of this
+      // process may use; by default, the processes on a machine share its
+      // cores evenly:
+      Utilities::MPI::MPI_InitFinalize mpi_initialization (argc, argv,
+                                                           options.threads_per_process);
+
+      if (!options.trace_file.empty())
+        {
+          trace_recorder.enable ();
+          trace_recorder.name_this_thread ("main");
+        }
+
+      if (options.benchmark.empty())
+        {
+          if (options.parallel_mode == ParallelMode::serial)
+            {
+              AssertThrow (Utilities::MPI::n_mpi_processes (MPI_COMM_WORLD) == 1,
+                           ExcMessage ("When running on several processes, "
+                                       "use --parallel=shared or "
+                                       "--parallel=distributed."));
+              first_grid (options);
+              second_grid (options);
+            }
+          else
+            second_grid_in_parallel (options);
+        }
+      else
+        run_benchmark (options);
+
+      // All threads have finished their work at this point, and we can
+      // write the timeline if one was recorded:
+      if (!options.trace_file.empty())
+        {
+          const std::unique_ptr<std::ostream> out
+            = open_output_file (options.trace_file);
+          trace_recorder.write_json (*out);
+          close_output_file (*out);
+          std::cout << "Timeline with " << trace_recorder.n_events()
+                    << " events written to " << options.trace_file
+                    << std::endl;
+        }
+    }
+  catch (std::exception &exc)
+    {
+      std::cerr << std::endl << std::endl
+                << "----------------------------------------------------"
+                << std::endl;
+      std::cerr << "Exception on processing: " << std::endl
+                << exc.what() << std::endl
+                << "Aborting!" << std::endl
+                << "----------------------------------------------------"
+                << std::endl;
+
+      return 1;
+    }
+  catch (...)
+    {
+      std::cerr << std::endl << std::endl
+                << "----------------------------------------------------"
+                << std::endl;
+      std::cerr << "Unknown exception!" << std::endl
+                << "Aborting!" << std::endl
+                << "----------------------------------------------------"
+                << std::endl;
+      return 1;
+    }
+
+  return 0;
+}